@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+
+# Sends firmware or spiffs to all devices listening for multicast OTA (see OtaHelper::MulticastOta) at once.
+#
+# Protocol, all fields little endian:
+#   header:   magic "OTAM", type (u8), flash mode (u8, 0 firmware, 1 spiffs), block size (u16), session id (u32),
+#             index (u32, block for DATA, group for PARITY, number of blocks for NACK)
+#   ANNOUNCE: image size (u32), group size (u16), reserved (u16), sequence (u32), image MD5 (32 hex chars), token
+#             (32 hex chars, tag of header and announcement up to the token, or zeroes without password)
+#   DATA:     block, last block may be short
+#   PARITY:   XOR of all blocks of a group, zero padded to block size
+#   END:      no payload, sent repeatedly after the last block
+#   NACK:     list of missing block indices (u32), sent by devices to the sender after END. Answered with DATA, unicast.
+#
+# With a password, DATA, PARITY and END end with a tag of the sequence (u32) followed by the packet. Tags are
+# HMAC-SHA256 with the password as key, truncated to 16 bytes. Devices only accept a sequence higher than the one of
+# the last transmission they applied, so the sequence defaults to the current unix time.
+
+import argparse
+import hashlib
+import hmac
+import os
+import random
+import select
+import socket
+import struct
+import sys
+import time
+
+MAGIC = 0x4D41544F
+ANNOUNCE = 1
+DATA = 2
+PARITY = 3
+END = 4
+NACK = 5
+
+HEADER = struct.Struct("<IBBHII")
+
+
+class Sender:
+    def __init__(self, args, image):
+        self.args = args
+        self.image = image
+        self.session_id = random.randint(1, 0xFFFFFFFF)
+        self.flash_mode = 1 if args.spiffs else 0
+        self.sequence = args.sequence if args.sequence is not None else int(time.time())
+        self.block_count = (len(image) + args.block_size - 1) // args.block_size
+        self.target = (args.group, args.port)
+        self.sent_bytes = 0
+        self.started = time.monotonic()
+
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, args.ttl)
+        # Loop back, so that a receiver on this host also gets the transmission.
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+        if args.interface:
+            self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(args.interface))
+        self.sock.bind(("", 0))
+
+    def header(self, packet_type, index=0):
+        return HEADER.pack(MAGIC, packet_type, self.flash_mode, self.args.block_size, self.session_id, index)
+
+    def tag(self, data):
+        return hmac.new(self.args.password.encode(), data, hashlib.sha256).digest()[:16]
+
+    def seal(self, packet):
+        if not self.args.password:
+            return packet
+        return packet + self.tag(struct.pack("<I", self.sequence) + packet)
+
+    def block(self, index):
+        return self.image[index * self.args.block_size:(index + 1) * self.args.block_size]
+
+    def send(self, packet, address=None):
+        self.sock.sendto(packet, address or self.target)
+        self.sent_bytes += len(packet)
+        # Pace to the given rate, as there is no flow control.
+        expected = self.sent_bytes / (self.args.rate * 1024)
+        elapsed = time.monotonic() - self.started
+        if expected > elapsed:
+            time.sleep(expected - elapsed)
+
+    def announce(self):
+        md5 = hashlib.md5(self.image).hexdigest()
+        packet = self.header(ANNOUNCE) + struct.pack("<IHHI", len(self.image), self.args.group_size, 0,
+                                                     self.sequence) + md5.encode()
+        token = self.tag(packet).hex() if self.args.password else "0" * 32
+        self.send(packet + token.encode())
+
+    def send_parity(self, group):
+        parity = bytearray(self.args.block_size)
+        first = group * self.args.group_size
+        for index in range(first, min(first + self.args.group_size, self.block_count)):
+            for i, b in enumerate(self.block(index)):
+                parity[i] ^= b
+        self.send(self.seal(self.header(PARITY, group) + bytes(parity)))
+
+    def transmit(self):
+        print("Announcing session %d for %.1fs..." % (self.session_id, self.args.lead_time))
+        # Lets devices join the session before the first blocks, so fewer blocks need repair.
+        lead_end = time.monotonic() + self.args.lead_time
+        while time.monotonic() < lead_end:
+            self.announce()
+            time.sleep(0.2)
+
+        print("Sending %d blocks of %d bytes to %s:%d..." %
+              (self.block_count, self.args.block_size, self.args.group, self.args.port))
+        self.started = time.monotonic()
+        self.sent_bytes = 0
+        for index in range(self.block_count):
+            self.send(self.seal(self.header(DATA, index) + self.block(index)))
+            if (index + 1) % self.args.group_size == 0 or index + 1 == self.block_count:
+                self.send_parity(index // self.args.group_size)
+            # Announce now and then, so that late devices join.
+            if index % 256 == 255:
+                self.announce()
+
+    def repair(self):
+        print("Serving repair requests for %ds..." % self.args.repair_time)
+        deadline = time.monotonic() + self.args.repair_time
+        next_end = 0
+        while time.monotonic() < deadline:
+            if time.monotonic() >= next_end:
+                self.sock.sendto(self.seal(self.header(END)), self.target)
+                next_end = time.monotonic() + 0.5
+            readable, _, _ = select.select([self.sock], [], [], 0.1)
+            if not readable:
+                continue
+            packet, address = self.sock.recvfrom(2048)
+            if len(packet) < HEADER.size:
+                continue
+            magic, packet_type, _, _, session_id, count = HEADER.unpack_from(packet)
+            if magic != MAGIC or packet_type != NACK or session_id != self.session_id:
+                continue
+            if len(packet) < HEADER.size + 4 * count:
+                continue
+            indices = struct.unpack_from("<%dI" % count, packet, HEADER.size)
+            print("%s requested %d blocks" % (address[0], len(indices)))
+            self.started = time.monotonic()
+            self.sent_bytes = 0
+            for index in indices:
+                if index < self.block_count:
+                    self.send(self.seal(self.header(DATA, index) + self.block(index)), address)
+            # Keep serving as long as there are requests.
+            deadline = max(deadline, time.monotonic() + 5)
+
+
+parser = argparse.ArgumentParser(description='Upload firmware to all OTA targets listening for multicast')
+
+parser.add_argument('-g', '--group', default="239.255.77.77", help="Multicast group")
+parser.add_argument('-p', '--port', type=int, default=3234, help="Multicast port")
+parser.add_argument('-i', '--interface', help="IP of the local interface to send from")
+parser.add_argument('-a', '--password', help="Password, if set on the devices")
+parser.add_argument('-s', '--spiffs', action='store_true', help="Upload spiffs instead of firmware")
+parser.add_argument('--block-size', type=int, default=1024, help="Block size, multiple of 16 from 512 to 1408")
+parser.add_argument('--group-size', type=int, default=8, help="Blocks per parity block, at most 64")
+parser.add_argument('--rate', type=int, default=200, help="Send rate in KiB/s")
+parser.add_argument('--lead-time', type=float, default=2, help="Seconds to announce before sending")
+parser.add_argument('--repair-time', type=int, default=10, help="Seconds to wait for repair requests after sending")
+parser.add_argument('--sequence', type=int, help="Sequence of this transmission, defaults to the current unix time")
+parser.add_argument('--ttl', type=int, default=1, help="Multicast TTL")
+parser.add_argument('firmware', help="Path to the firmware.bin that should be uploaded")
+
+args = parser.parse_args()
+
+if not os.path.isfile(args.firmware):
+    sys.exit("Firmare file %s does not exists." % args.firmware)
+if args.block_size < 512 or args.block_size > 1408 or args.block_size % 16 != 0:
+    sys.exit("Invalid block size %d" % args.block_size)
+if args.group_size < 1 or args.group_size > 64:
+    sys.exit("Invalid group size %d" % args.group_size)
+
+with open(args.firmware, "rb") as f:
+    sender = Sender(args, f.read())
+
+sender.transmit()
+sender.repair()
+print("Upload complete!")
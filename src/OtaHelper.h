@@ -1,6 +1,8 @@
 #ifndef __OTA_HELPER_H__
 #define __OTA_HELPER_H__
 
+#include <atomic>
+#include <esp_app_format.h>
 #include <esp_err.h>
 #include <esp_event.h>
 #include <esp_http_client.h>
@@ -8,16 +10,30 @@
 #include <esp_log.h>
 #include <esp_netif.h>
 #include <esp_partition.h>
+#include <esp_pm.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <functional>
 #include <inttypes.h>
+#include <lwip/sockets.h>
+#include <memory>
 #include <optional>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string>
+#include <string_view>
 #include <vector>
 
+namespace ConnectionHelperUtils {
+class ChunkedDecoder;
+class MD5Builder;
+} // namespace ConnectionHelperUtils
+
 namespace OtaHelperLog {
 const char TAG[] = "OtaHelper";
 };
@@ -34,6 +50,8 @@ const char TAG[] = "OtaHelper";
  * same URI and setting the "X-Flash-Mode" header to either "firmware" or "spiffs". Like this:
  *   curl -X POST -H "X-Flash-Mode: firmware" -H "Content-Type: application/octet-stream" \
  *        --data-binary "@/path/to/firmware.bin" http://<device-ip>:<port-number>/
+ *   Chunked uploads (without content length) are also supported, e.g. when streaming from a pipe using curl with
+ *   -H "Transfer-Encoding: chunked" --data-binary @-
  * - Using URI via remote HTTP server, invoked by the device itself.
  */
 class OtaHelper {
@@ -69,6 +87,47 @@ public:
      * this high, but if high it will also potentially also starve your other tasks.
      */
     UBaseType_t task_priority = (configMAX_PRIORITIES - 1);
+    /**
+     * Stack size of the UDP update task, in bytes. The update itself is written from this task.
+     */
+    uint32_t task_stack_size = 4096;
+    /**
+     * The core to pin the UDP update task to, or tskNO_AFFINITY to run on any core.
+     */
+    BaseType_t task_core_id = tskNO_AFFINITY;
+  };
+
+  /**
+   * @brief Configuration for OTA via UDP multicast, to update many devices at once with a single transmission, using
+   * multicast_upload.py. Blocks are written as they arrive, in any order. A lost block is recovered from XOR parity if
+   * it is the only one lost within its group, otherwise it is requested again from the sender (unicast) once the
+   * sender signals the end of the transmission. Requires IGMP in lwIP (CONFIG_LWIP_IGMP, enabled by default). Not
+   * affected by on demand activation.
+   */
+  struct MulticastOta {
+    bool enabled = false;
+    std::string group = "239.255.77.77";
+    uint16_t port = 3234;
+    /**
+     * Set password to non empty string to only accept transmissions sent with the same password. All packets are then
+     * authenticated (HMAC-SHA256), and announcements must carry a higher sequence than the last applied transmission,
+     * stored in NVS, so that recorded transmissions can not be replayed to downgrade. Note that the image itself is
+     * not encrypted. Without password, anyone on the network can update the device.
+     */
+    std::string password = "";
+    /**
+     * Max time without receiving any block for an ongoing transmission, including repair, before giving up, in
+     * milliseconds.
+     */
+    uint32_t timeout_ms = 30000;
+
+    /**
+     * Priority, stack size (in bytes) and core (or tskNO_AFFINITY) of the receiving task. The update is written from
+     * this task.
+     */
+    UBaseType_t task_priority = 5;
+    uint32_t task_stack_size = 4096;
+    BaseType_t task_core_id = tskNO_AFFINITY;
   };
 
   struct Credentials {
@@ -99,19 +158,54 @@ public:
 
     /**
      * Set username to non empty string to enable authentication.
-     * Note: Only Basic authentication is supported.
+     * Note: Basic authentication is used unless digest_auth is set.
      * Note: You might need to set
      * https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/kconfig.html#config-httpd-max-req-hdr-len
      * to 1024 or higher in menuconfig in case of "431 Request Header Fields Too Large - Header fields are too long for
      * server to interpret" errors.
      */
     Credentials credentials = {};
+    /**
+     * If true, Digest authentication (RFC 7616, MD5, qop=auth) is used instead of Basic, so that the password is never
+     * sent. Supported by browsers and by curl using --digest -u <username>:<password>.
+     */
+    bool digest_auth = false;
+    /**
+     * Time a session cookie, set after successful authentication, is valid in milliseconds. Requests with the cookie
+     * skip authentication. There is one session at a time, bound to the IP address of the client that authenticated;
+     * authenticating from another client ends it. 0 to not use sessions.
+     * Note: The cookie is sent over plain HTTP, so anyone able to sniff the network can take over the session from the
+     * same IP address (e.g. behind the same NAT) until it expires. Set to 0 if that is a concern.
+     */
+    uint32_t session_timeout_ms = 10 * 60 * 1000;
+
+    /**
+     * Priority, stack size (in bytes) and core (or tskNO_AFFINITY) of the HTTP server task. Web updates are written
+     * from this task. Defaults are the same as ESP-IDF HTTPD_DEFAULT_CONFIG().
+     */
+    UBaseType_t task_priority = tskIDLE_PRIORITY + 5;
+    uint32_t task_stack_size = 4096;
+    BaseType_t task_core_id = tskNO_AFFINITY;
+
+    /**
+     * If true, the running firmware is served at GET /firmware, so that other devices can update from this one, e.g.
+     * to distribute an update over LAN instead of downloading it from a remote server on each device:
+     *   updateFrom("http://<device-ip>:<port-number>/firmware", FlashMode::FIRMWARE)
+     * Use http://<username>:<password>@<device-ip>... if credentials are set. The image MD5 and SHA-256 and the app
+     * description are sent in X-Image-* and X-App-* headers. updateFrom() validates against X-Image-MD5 if no MD5 is
+     * given. Note that the HTTP server handles one request at a time, so web OTA has to wait while serving.
+     */
+    bool serve_firmware = false;
+    /**
+     * Max rate when serving the running firmware, in bytes per second. 0 for unlimited.
+     */
+    uint32_t serve_max_bytes_per_second = 0;
   };
 
   enum class RollbackStrategy {
     /**
      * @brief The OtaHelper will automatically mark the new firmware as OK once all OTA services are up and
-     * rollback_timeout_ms has passed.
+     * rollback_timeout_ms has passed, or once all health probes have passed (see addHealthProbe()).
      */
     AUTO,
     /**
@@ -121,9 +215,288 @@ public:
     MANUAL,
   };
 
+  /**
+   * @brief Configuration for power management while an update is being written, regardless of transport.
+   */
+  struct PowerManagement {
+    /**
+     * If true, WiFi power save is disabled (WIFI_PS_NONE) while an update is being written, as modem sleep severely
+     * throttles TCP throughput. The previous mode (e.g. the one set using WiFiHelper::setPowerSaveMode()) is restored
+     * once the update completes or fails.
+     */
+    bool disable_wifi_power_save = true;
+    /**
+     * If true, the CPU frequency is locked to max using a PM lock while an update is being written.
+     * Only has effect if power management is enabled in menuconfig (CONFIG_PM_ENABLE).
+     */
+    bool lock_cpu_frequency = false;
+  };
+
+  /**
+   * @brief Configuration for verification of written data, before a firmware partition is set as boot partition.
+   */
+  struct Verification {
+    /**
+     * If true, the written range is read back using memory mapped flash and its MD5 is compared against the received
+     * data. Catches flash write faults (e.g. on aging modules) at flash cache speed, without a second transfer.
+     */
+    bool readback = true;
+    /**
+     * If true, firmware is validated using esp_image_verify() (segments, checksum and appended SHA-256 hash).
+     */
+    bool verify_app_image = true;
+  };
+
+  /**
+   * @brief Rules for accepting a firmware image, checked on the first received chunk before anything is erased, so that
+   * bad uploads are rejected right away instead of after a full transfer. Regardless of these rules, the size of any
+   * upload (firmware or spiffs) is checked against the target partition before starting.
+   */
+  struct ImageValidation {
+    /**
+     * If true, the image must be built for the chip (target) this is running on.
+     */
+    bool check_chip = true;
+    /**
+     * If true, the min chip revision of the image must not be higher than the revision of this chip.
+     */
+    bool check_chip_revision = true;
+    /**
+     * If true, the project name of the image must be the same as the one of the running firmware.
+     */
+    bool require_same_project = false;
+    /**
+     * If true, an image with the same version as the running firmware is rejected.
+     */
+    bool reject_same_version = false;
+    /**
+     * If true and anti rollback is enabled in menuconfig (CONFIG_BOOTLOADER_APP_ANTI_ROLLBACK), the secure version of
+     * the image must not be lower than the one in eFuse.
+     */
+    bool check_secure_version = true;
+    /**
+     * Optional custom rule, called with the description of the new and of the running firmware. Return false to reject
+     * the image.
+     */
+    std::function<bool(const esp_app_desc_t &new_app, const esp_app_desc_t &running_app)> accept_app = {};
+  };
+
+  /**
+   * @brief Configuration for pacing of flash and CPU use while writing an update, so that an update does not starve
+   * other tasks. Erasing/writing flash disables the flash cache, stalling any task or ISR running from flash.
+   * The defaults do not limit anything.
+   */
+  struct Pacing {
+    /**
+     * Max average write rate in bytes per second. 0 for unlimited.
+     */
+    uint32_t max_bytes_per_second = 0;
+    /**
+     * Max continuous time spent in flash erase/write operations before yielding for flash_yield_ms, in milliseconds.
+     * 0 for unlimited.
+     */
+    uint32_t max_flash_busy_ms = 0;
+    /**
+     * Time to yield once max_flash_busy_ms has been reached, in milliseconds. At least one tick.
+     */
+    uint32_t flash_yield_ms = 10;
+    /**
+     * Max size of a single erase operation, in bytes. Must be a multiple of the flash sector size (4k). Smaller
+     * chunks means shorter stalls but slightly slower erase.
+     */
+    uint32_t erase_chunk_size = 16 * 4096;
+  };
+
+  /**
+   * @brief Configuration for staging received data in a large ring buffer, preferably in external RAM (PSRAM), so that
+   * receiving continues while the flash is busy erasing/writing and TCP receive windows stay open. When used, data is
+   * received by a separate task and written to flash from the task of the transport.
+   */
+  struct Staging {
+    /**
+     * Size of the ring buffer in bytes, rounded down to a multiple of the chunk size (see Transfer). 0 (or less than
+     * two chunks) to not use staging, in which case data is received directly into a single chunk sized buffer.
+     * Allocated in PSRAM if available, otherwise in internal RAM. If allocation fails, staging is not used.
+     */
+    uint32_t size = 0;
+    /**
+     * Priority, stack size (in bytes) and core (or tskNO_AFFINITY) of the receiving task. The task is created for each
+     * update. If static_allocation is set, its stack and queues are reserved at construction along with the buffer,
+     * and the task is kept once created on the first update.
+     */
+    UBaseType_t task_priority = tskIDLE_PRIORITY + 5;
+    uint32_t task_stack_size = 4096;
+    BaseType_t task_core_id = tskNO_AFFINITY;
+  };
+
+  /**
+   * @brief Configuration for buffer sizes and timeouts of the update pipeline, regardless of transport. Larger chunks
+   * mean fewer and larger flash writes and socket reads, at the cost of RAM. The best values depend on board and
+   * network.
+   */
+  struct Transfer {
+    /**
+     * Size of the update buffer in bytes, i.e. how much is received before each flash write. Rounded down to a multiple
+     * of the flash sector size (4k), between 4k and 64k. Also the slot size of the staging ring buffer (see Staging).
+     */
+    uint32_t chunk_size = 4096;
+    /**
+     * Receive and transmit buffer sizes of the HTTP client used by updateFrom(), in bytes, and its network timeout in
+     * milliseconds.
+     */
+    uint32_t http_rx_buffer_size = 4096;
+    uint32_t http_tx_buffer_size = 512;
+    uint32_t http_timeout_ms = 15000;
+    /**
+     * Receive timeout of web OTA uploads, in seconds.
+     */
+    uint16_t web_recv_timeout_s = 5;
+    /**
+     * Receive buffer size (SO_RCVBUF) of the ArduinoOTA TCP connection, in bytes. 0 for the lwIP default. Only has
+     * effect if CONFIG_LWIP_SO_RCVBUF is enabled in menuconfig.
+     */
+    uint32_t arduino_ota_rcvbuf = 0;
+    /**
+     * Receive timeout of the ArduinoOTA TCP connection, in milliseconds. 0 to wait forever.
+     */
+    uint32_t arduino_ota_recv_timeout_ms = 15000;
+  };
+
+  /**
+   * @brief Configuration for erasing the next update (firmware) partition in the background once the running firmware
+   * has been confirmed (see RollbackStrategy), so that the next firmware update can start writing right away instead of
+   * erasing first. Progress is kept in NVS, so erasing resumes after a restart. NVS must be initialized
+   * (nvs_flash_init()), which WiFiHelper does.
+   * Note that this removes the previous firmware, so it can no longer be rolled back to once confirmed.
+   */
+  struct PreErase {
+    bool enabled = false;
+    /**
+     * Size of each erase step in bytes, rounded down to a multiple of the flash sector size (4k), and the delay between
+     * steps in milliseconds. Erasing stalls any task or ISR running from flash, so keep steps small.
+     */
+    uint32_t step_size = 4 * 4096;
+    uint32_t step_delay_ms = 50;
+    /**
+     * Priority, stack size (in bytes) and core (or tskNO_AFFINITY) of the erase task, which exits once done.
+     */
+    UBaseType_t task_priority = tskIDLE_PRIORITY + 1;
+    uint32_t task_stack_size = 3072;
+    BaseType_t task_core_id = tskNO_AFFINITY;
+  };
+
+  /**
+   * @brief Configuration for on demand activation of web OTA and ArduinoOTA, to reclaim their heap while idle.
+   *
+   * When enabled, start() does not start the HTTP server nor the ArduinoOTA task. Instead only a small UDP wake
+   * listener is kept running. The services are started when receiving a wake packet (or when calling activate()) and
+   * stopped again after idle_timeout_ms without requests. Authentication of the services themselves still applies.
+   * For example, to wake the device before updating using espota or the web UI:
+   *   echo -n WAKE | nc -u -w1 <device-ip> 3233
+   */
+  struct OnDemand {
+    bool enabled = false;
+    /**
+     * UDP port of the wake listener. 0 to not start the wake listener, in which case the services must be started by
+     * calling activate().
+     */
+    uint16_t wake_udp_port = 3233;
+    /**
+     * Time without requests after which the services are stopped, in milliseconds. Never stopped during an update.
+     */
+    uint32_t idle_timeout_ms = 5 * 60 * 1000;
+    /**
+     * Priority, stack size (in bytes) and core (or tskNO_AFFINITY) of the wake listener task. The services are started
+     * from this task.
+     */
+    UBaseType_t wake_task_priority = 5;
+    uint32_t wake_task_stack_size = 3072;
+    BaseType_t wake_task_core_id = tskNO_AFFINITY;
+  };
+
+  /**
+   * @brief Configuration for arbitration between update sources. Only one update (session) can be in progress at a
+   * time. While busy, pushed updates are rejected right away: web OTA with HTTP 503 and ArduinoOTA with an error reply
+   * to the invitation.
+   */
+  struct Arbitration {
+    /**
+     * If true, updateFrom() waits up to pull_queue_timeout_ms for an ongoing update to complete, instead of failing
+     * right away.
+     */
+    bool queue_pull_requests = false;
+    uint32_t pull_queue_timeout_ms = 5 * 60 * 1000;
+  };
+
+  /**
+   * @brief Configuration for the HTTP client used by updateFrom().
+   */
+  struct RemoteHttp {
+    /**
+     * If true, the HTTP client, its connection (HTTP keep-alive) and TLS session are kept after updateFrom() and reused
+     * by the next call for the same origin (scheme, user info, host and port), avoiding a new TCP and TLS handshake.
+     * The kept client holds its buffers and, for HTTPS, the TLS context (~30-40k of heap). Call
+     * closeRemoteConnection() to release it.
+     */
+    bool reuse_connection = false;
+    /**
+     * If true, the TLS session is saved and resumed (session tickets) when the kept client has to reconnect, e.g. when
+     * the server closed the idle connection, which is much cheaper than a full handshake. Requires ESP-IDF 5.0+ and
+     * CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS in menuconfig.
+     */
+    bool resume_tls_session = true;
+    /**
+     * Max number of redirects to follow. Redirects to the same origin use the same connection.
+     */
+    uint8_t max_redirects = 5;
+  };
+
+  /**
+   * @brief Configuration for serving the UDP listeners (ArduinoOTA, on demand wake and multicast) from one task.
+   */
+  struct Reactor {
+    /**
+     * If true, a single task waits on all UDP sockets with select() instead of one blocking task per listener, which
+     * saves the stack and control block of the other tasks. An espota transfer or multicast update is written from
+     * this task, so while one is running, the other listeners are not served. The priority, stack size and core
+     * settings of the individual listeners are not used. The web OTA still runs in the HTTP server task.
+     */
+    bool enabled = false;
+    /**
+     * Priority, stack size (in bytes) and core (or tskNO_AFFINITY) of the reactor task. The update is written from
+     * this task.
+     */
+    UBaseType_t task_priority = 5;
+    uint32_t task_stack_size = 4096;
+    BaseType_t task_core_id = tskNO_AFFINITY;
+  };
+
+  /**
+   * @brief Configuration for start().
+   */
+  struct Startup {
+    /**
+     * If true, start() does not wait for the web server (web OTA) to start. It is started from a short lived task,
+     * in parallel with the UDP listeners binding their sockets, and start() returns once all tasks are created. In
+     * that case, the return value of start() only covers creating the tasks; use setOnReady() to know when all
+     * services are up. Not used with on demand activation, where start() does not start the web server.
+     */
+    bool async = false;
+    /**
+     * Priority, stack size (in bytes) and core (or tskNO_AFFINITY) of the task starting the web server, if async.
+     */
+    UBaseType_t task_priority = 5;
+    uint32_t task_stack_size = 3072;
+    BaseType_t task_core_id = tskNO_AFFINITY;
+  };
+
   struct Configuration {
     WebOta web_ota = {};
     ArduinoOta arduino_ota = {};
+    MulticastOta multicast_ota = {};
+    PowerManagement power_management = {};
+    OnDemand on_demand = {};
+    Arbitration arbitration = {};
     /**
      * @brief Rollback must be enabled in menuconfig where
      * https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/kconfig.html#config-bootloader-app-rollback-enable
@@ -136,9 +509,33 @@ public:
     RollbackStrategy rollback_strategy = RollbackStrategy::AUTO;
     /**
      * If roolback strategy is AUTO, this is the timeout to wait for the new firmware to be marked as valid, in
-     * milliseconds.
+     * milliseconds. Not used if health probes are registered, see addHealthProbe().
      */
     uint32_t rollback_timeout_ms = 5000;
+    /**
+     * Priority, stack size (in bytes) and core (or tskNO_AFFINITY) of the rollback watcher task, if started.
+     */
+    UBaseType_t rollback_task_priority = 5;
+    uint32_t rollback_task_stack_size = 2048;
+    BaseType_t rollback_task_core_id = tskNO_AFFINITY;
+    Verification verification = {};
+    ImageValidation image_validation = {};
+    Pacing pacing = {};
+    Staging staging = {};
+    Transfer transfer = {};
+    RemoteHttp remote_http = {};
+    PreErase pre_erase = {};
+    Reactor reactor = {};
+    Startup startup = {};
+    /**
+     * If true, the update buffer, the stacks of all tasks started by OtaHelper and their control blocks are allocated
+     * once at construction, instead of at start() and on each update. Same for the staging ring buffer, if used. This
+     * way updates do not depend on free and unfragmented heap at the time of the update, and the per chunk write path
+     * does not allocate.
+     * Note that the HTTP server (web OTA) still allocates its own resources when started in start(). With on demand
+     * activation, the ArduinoOTA task is always allocated on activation so its stack can be released when idle.
+     */
+    bool static_allocation = false;
   };
 
   enum class OtaStatus {
@@ -173,12 +570,145 @@ public:
    */
   bool start();
 
+  /**
+   * @brief Callback when the OTA services are ready after start().
+   *
+   * @param ready true if all enabled services are up (with on demand activation: the wake listener), false as soon as
+   * one of them failed to start.
+   */
+  using OnReady = std::function<void(bool ready)>;
+
+  /**
+   * @brief Set callback for when the OTA services are ready, see OnReady. Called once per start(), from start() itself
+   * or from the task that started the last service. Set before calling start().
+   */
+  void setOnReady(OnReady on_ready) { _ready_callback = on_ready; }
+
   /**
    * @brief If the rollback strategy is MANUAL, call this to confirm that the new firmware is OK. Otherwise the previous
    * image will be rolled back on reboot (if rollback is enabled in menuconfig, see RollbackStrategy).
    */
   void cancelRollback();
 
+  /**
+   * @brief Register a health probe for rollback confirmation, e.g. "MQTT connected" or "sensor read OK". Call before
+   * start(). With RollbackStrategy::AUTO and at least one probe, new firmware is confirmed as soon as the OTA services
+   * are up and all probes have reported healthy, without waiting for rollback_timeout_ms. If a probe reports unhealthy
+   * or has not reported healthy within its deadline, the new firmware is marked invalid and the device reboots into the
+   * previous one right away. Probes are only evaluated for firmware pending verification, i.e. on the first boot after
+   * an update.
+   *
+   * @param name name of the probe, for logs.
+   * @param deadline_ms time after start() within which the probe must report healthy.
+   * @return id of the probe to pass to reportHealth(), or -1 if too many probes (8) or already started.
+   */
+  int addHealthProbe(const std::string &name, uint32_t deadline_ms);
+
+  /**
+   * @brief Report the result of a health probe, see addHealthProbe(). Can be called from any task, also before start().
+   * Once a probe has reported healthy, later reports are ignored.
+   */
+  void reportHealth(int probe_id, bool healthy);
+
+  struct HealthProbeStatus {
+    std::string name;
+    uint32_t deadline_ms = 0;
+    int64_t passed_us = 0; // When reported healthy, in microseconds since boot. 0 if not (yet).
+    bool failed = false;   // Reported unhealthy.
+  };
+
+  /**
+   * @brief Return the registered health probes and their results.
+   */
+  std::vector<HealthProbeStatus> getHealthProbes();
+
+  /**
+   * @brief If on demand activation is enabled (see OnDemand), start the web OTA and ArduinoOTA services if not already
+   * running. The idle timeout is restarted on each call.
+   *
+   * @return true if the services are active.
+   */
+  bool activate();
+
+  /**
+   * @brief If on demand activation is enabled (see OnDemand), stop the web OTA and ArduinoOTA services and release
+   * their heap. Does nothing if an update is in progress.
+   */
+  void deactivate();
+
+  /**
+   * @brief Return true if the web OTA and ArduinoOTA services (as enabled) are running.
+   */
+  bool isActive() { return _active; }
+
+  /**
+   * @brief Heap used by OtaHelper, measured as the drop in free heap when starting services. Approximate, as other
+   * tasks might allocate or free at the same time.
+   */
+  struct MemoryUsage {
+    bool active = false;
+    size_t idle_bytes = 0;   // Heap used while idle, i.e. by the wake listener. 0 unless on demand is enabled.
+    size_t active_bytes = 0; // Additional heap used by the services while active, as of last activation.
+  };
+
+  /**
+   * @brief Return heap used by OtaHelper in idle and active state.
+   */
+  MemoryUsage getMemoryUsage() { return {_active, _idle_heap_usage, _active_heap_usage}; }
+
+  /**
+   * @brief Timestamps of each phase of start(), in microseconds since boot (esp_timer_get_time()). 0 if the phase has
+   * not been reached or does not apply. A one line summary is logged once all phases have been reached.
+   */
+  struct StartupTimings {
+    int64_t start_called_us = 0;
+    int64_t start_returned_us = 0;
+    int64_t ready_us = 0;                // All enabled services up (see setOnReady()).
+    int64_t httpd_started_us = 0;        // Web OTA server started and handlers registered.
+    int64_t udp_bound_us = 0;            // ArduinoOTA UDP socket bound.
+    int64_t rollback_confirmed_us = 0;   // Running firmware marked as valid.
+    int64_t health_probes_passed_us = 0; // Last health probe reported healthy (see addHealthProbe()).
+  };
+
+  /**
+   * @brief Return the timings of start().
+   */
+  StartupTimings getStartupTimings();
+
+  enum class UpdateSource {
+    NONE,
+    WEB_OTA,     // Pushed using local HTTP web server/UI.
+    ARDUINO_OTA, // Pushed using ArduinoOTA (espota).
+    REMOTE_HTTP, // Pulled using updateFrom().
+    SINK,        // Pushed using OtaSink.
+    MULTICAST,   // Pushed using UDP multicast.
+  };
+
+  /**
+   * @brief Return true if an update (from any source) is in progress.
+   */
+  bool isUpdateInProgress() { return _session_source != UpdateSource::NONE; }
+
+  /**
+   * @brief Statistics for the last (or ongoing) update, regardless of transport.
+   */
+  struct UpdateStatistics {
+    uint32_t session_id = 0; // Increasing id of the update session, also used in logs.
+    UpdateSource source = UpdateSource::NONE;
+    size_t bytes_written = 0;
+    uint32_t duration_ms = 0;
+    uint32_t flash_busy_ms = 0;      // Total time spent in flash erase/write operations.
+    uint32_t max_flash_stall_us = 0; // Longest single flash erase/write operation, i.e. worst case stall caused.
+    uint32_t throttled_ms = 0;       // Total time yielded due to pacing (see Pacing).
+    size_t staging_peak_bytes = 0;   // Max data waiting in the staging ring buffer (see Staging).
+    size_t chunk_size = 0;           // Size of each flash write (see Transfer).
+  };
+
+  /**
+   * @brief Return statistics for the last (or ongoing) update.
+   */
+  UpdateStatistics getLastUpdateStatistics() { return _update_statistics; }
+
   enum class FlashMode {
     FIRMWARE,
     SPIFFS,
@@ -196,6 +726,94 @@ public:
    */
   bool updateFrom(std::string &url, FlashMode flash_mode, std::string md5_hash = "");
 
+  /**
+   * @brief Close the connection kept by updateFrom(), if any (see RemoteHttp::reuse_connection), and release its heap.
+   * Waits for an ongoing update to complete.
+   */
+  void closeRemoteConnection();
+
+  /**
+   * @brief Push style writer for firmware/spiffs images arriving from any source, e.g. MQTT, BLE, UART or SD card.
+   * Data is written to flash as it arrives, with the same erase, pacing, validation and verification as web OTA,
+   * ArduinoOTA and updateFrom(), which all use this internally. Whole sectors (4k) are written directly from the given
+   * data when nothing is buffered and at least a chunk (see Transfer) is given, so pushing in multiples of the chunk
+   * size avoids copying.
+   *
+   * Only one update can be in progress at a time (see Arbitration). Not thread safe, but begin(), write(), finish()
+   * and abort() can be called from different tasks (e.g. MQTT or BLE callbacks) as long as the calls do not overlap.
+   * Will not restart/reboot on success, caller is responsible to reboot (or at a convinient time).
+   */
+  class OtaSink {
+  public:
+    /**
+     * @brief Size to pass to begin() if the size of the image is not known up front, e.g. when streamed. The image is
+     * then bounded by the size of the partition, and finish() commits whatever has been written.
+     */
+    static constexpr size_t UNKNOWN_SIZE = SIZE_MAX;
+
+    explicit OtaSink(OtaHelper &ota_helper) : OtaSink(ota_helper, true) {}
+    ~OtaSink();
+    OtaSink(const OtaSink &) = delete;
+    OtaSink &operator=(const OtaSink &) = delete;
+
+    /**
+     * @brief Start an update.
+     *
+     * @param flash_mode flash mode to use.
+     * @param size total size of the image in bytes, or UNKNOWN_SIZE.
+     * @param md5_hash 32 character MD5 hash to validate written firmware/spiffs against. Empty to not validate.
+     * @return true if started. If false, nothing has been written.
+     */
+    bool begin(FlashMode flash_mode, size_t size, std::string md5_hash = "");
+
+    /**
+     * @brief Write the next part of the image. On failure the update is aborted.
+     *
+     * @return true if successful.
+     */
+    bool write(const uint8_t *data, size_t length);
+
+    /**
+     * @brief Complete the update once all data has been written. Verifies the written data and, for firmware, sets
+     * the boot partition.
+     *
+     * @return true if successful.
+     */
+    bool finish();
+
+    /**
+     * @brief Abort an ongoing update. A partially written firmware is never bootable.
+     */
+    void abort();
+
+    bool isActive() { return _active; }
+    size_t bytesReceived() { return _received; }
+
+  private:
+    friend class OtaHelper;
+    OtaSink(OtaHelper &ota_helper, bool owns_session);
+    bool begin(const esp_partition_t *partition, FlashMode flash_mode, size_t size, std::string md5_hash);
+    int writeFrom(std::function<int(char *buffer, size_t buffer_size, size_t total_bytes_left)> &fill_buffer);
+    bool writeChunk(const char *data, size_t length);
+    void end(bool success);
+
+    OtaHelper &_ota;
+    bool _owns_session; // False when used by the built in transports, as they hold the session themselves.
+    bool _active = false;
+    const esp_partition_t *_partition = nullptr;
+    FlashMode _flash_mode = FlashMode::FIRMWARE;
+    std::string _md5_hash;
+    std::unique_ptr<ConnectionHelperUtils::MD5Builder> _md5; // Allocated by the first begin().
+    size_t _size = 0;
+    size_t _limit = 0; // Max size, either size or partition size if unknown.
+    size_t _received = 0;
+    size_t _written = 0;
+    char *_buffer = nullptr;
+    size_t _buffered = 0;
+    uint8_t _skip_buffer[16]; // ENCRYPTED_BLOCK_SIZE
+    int64_t _started_us = 0;
+  };
+
   /**
    * @brief Callback when this object want to log something.
    *
@@ -216,19 +834,52 @@ private: // OTA (generic)
   writeStreamToPartition(const esp_partition_t *partition, FlashMode flash_mode, size_t content_length,
                          std::string &md5hash,
                          std::function<int(char *buffer, size_t buffer_size, size_t total_bytes_left)> fill_buffer);
-  bool writeBufferToPartition(const esp_partition_t *partition, size_t bytes_written, char *buffer, size_t buffer_size,
-                              uint8_t skip);
+  bool writeStreamToSink(OtaSink &sink,
+                         std::function<int(char *buffer, size_t buffer_size, size_t total_bytes_left)> &fill_buffer);
+  bool writeStreamToSinkStaged(
+      OtaSink &sink, std::function<int(char *buffer, size_t buffer_size, size_t total_bytes_left)> &fill_buffer);
+  struct StagingContext;
+  static void stagingTask(void *pvParameters);
+  static void stagingWorkerTask(void *pvParameters);
+  void receiveStaged(StagingContext &ctx);
+  bool reserveStagingQueues(size_t slots);
+  char *allocateStagingBuffer(size_t size);
+  bool writeBufferToPartition(const esp_partition_t *partition, size_t bytes_written, const char *buffer,
+                              size_t buffer_size, uint8_t skip);
+  int64_t beginUpdate(const esp_partition_t *partition, FlashMode flash_mode);
+  bool commitUpdate(const esp_partition_t *partition, FlashMode flash_mode, const uint8_t *skip_buffer,
+                    int64_t started_us, const std::function<bool()> &verify_written);
+  void endUpdate();
 
+  bool forEachMappedWindow(const esp_partition_t *partition, size_t length,
+                           std::function<bool(const uint8_t *data, size_t length)> on_window);
+  bool verifyPartitionData(const esp_partition_t *partition, size_t length, const uint8_t *expected_md5,
+                           size_t expected_md5_length);
+  bool verifyAppImage(const esp_partition_t *partition);
+  bool validateImageHeader(const uint8_t *data, size_t length);
   esp_err_t partitionIsBootable(const esp_partition_t *partition);
   bool checkDataInBlock(const uint8_t *data, size_t len);
+  bool eraseUpTo(const esp_partition_t *partition, size_t end);
+  void onFlashOperationDone(int64_t started_us);
+  void paceStream(int64_t started_us, size_t bytes_written);
 
   const esp_partition_t *findPartition(FlashMode flash_mode);
 
+  void enterUpdatePowerMode();
+  void exitUpdatePowerMode();
+
 private: // OTA via local HTTP webserver / web UI
   bool startWebserver();
   int fillBuffer(httpd_req_t *req, char *buffer, size_t buffer_size);
+  int fillBufferChunked(httpd_req_t *req, ConnectionHelperUtils::ChunkedDecoder &decoder, char *buffer,
+                        size_t buffer_size);
 
-  void setNotAuthenticatedResonse(httpd_req_t *req);
+  void setNotAuthenticatedResonse(httpd_req_t *req, bool stale_nonce = false);
+  void prepareAuthentication();
+  bool checkBasicAuthorization(std::string_view authorization);
+  bool checkDigestAuthorization(httpd_req_t *req, std::string_view authorization, bool &stale_nonce);
+  bool hasValidSessionCookie(httpd_req_t *req);
+  void issueSessionCookie(httpd_req_t *req);
 
   // Return true if user is authenticated, or if no authentication is required.
   // Will set proper headers. If this returns false, caller should not continue or set anything.
@@ -236,12 +887,48 @@ private: // OTA via local HTTP webserver / web UI
 
   static esp_err_t httpGetHandler(httpd_req_t *req);
   static esp_err_t httpPostHandler(httpd_req_t *req);
+  static esp_err_t httpFirmwareGetHandler(httpd_req_t *req);
+
+  struct ServedImage {
+    size_t length = 0;
+    std::string md5;
+    std::string sha256;
+    std::string project_name;
+    std::string version;
+    std::string idf_version;
+    std::string secure_version;
+  };
+  const esp_partition_t *_served_partition = nullptr;
+  std::optional<ServedImage> _served_image;
+  bool loadServedImage();
+
+  // Authentication state, all only used from the HTTP server task.
+  std::string _basic_authorization; // Expected Authorization header, encoded once in start().
+  char _digest_ha1[33] = {};        // MD5 of username:realm:password, hex.
+  struct DigestNonce {
+    char value[33] = {};
+    uint32_t last_nc = 0; // Highest nonce count accepted, so that a captured request cannot be replayed.
+    int64_t created_us = 0;
+  };
+  // A new nonce per challenge once the previous one has been used, so that each client (e.g. each curl invocation)
+  // counts from 1.
+  static constexpr uint8_t MAX_DIGEST_NONCES = 4;
+  DigestNonce _digest_nonces[MAX_DIGEST_NONCES];
+  uint8_t _digest_next_nonce = 0;
+  std::string _www_authenticate; // Referenced by httpd until the response is sent.
+  char _session_token[33] = {};
+  uint8_t _session_client[16] = {}; // IP address of the client the session was issued to.
+  int64_t _session_expires_us = 0;
+  std::string _session_cookie; // Referenced by httpd until the response is sent.
 
 private: // OTA via remote URI
   bool downloadAndWriteToPartition(const esp_partition_t *partition, FlashMode flash_mode, std::string &url,
                                    std::string &md5hash);
   static esp_err_t httpEventHandler(esp_http_client_event_t *evt);
   int fillBuffer(esp_http_client_handle_t client, char *buffer, size_t buffer_size);
+  esp_http_client_handle_t acquireRemoteClient(std::string &url, bool &reused);
+  void releaseRemoteClient(esp_http_client_handle_t client, bool keep);
+  std::string originOf(const std::string &url);
 
 private: // OTA via ArduinoOTA
   static void arduinoOtaUdpServerTask(void *pvParameters);
@@ -258,20 +945,126 @@ private: // OTA via ArduinoOTA
     std::string md5;
   };
 
+  struct ArduinoOtaState {
+    bool waiting_for_auth = false;
+    std::string auth_nonce;
+    std::optional<ArduinoOtaHandshake> handshake_packet;
+  };
+
+  int openArduinoOtaSocket(uint32_t recv_timeout_ms);
+  void closeArduinoOtaSocket(int sock);
+  bool handleArduinoOtaPacket(int sock, ArduinoOtaState &state);
   std::optional<ArduinoAuthUpdate> parseAuthUdpPacket(char *buffer, size_t buffer_size);
   std::optional<ArduinoOtaHandshake> parseHandshakeUdpPacket(char *buffer, size_t buffer_size);
   bool connectToHostForArduino(ArduinoOtaHandshake &update, char *host_ip);
 
   int fillBuffer(int socket, char *buffer, size_t buffer_size, size_t total_bytes_left);
 
+private: // OTA via UDP multicast
+  static void multicastOtaTask(void *pvParameters);
+
+  struct MulticastSession {
+    uint32_t id = 0;
+    uint32_t sequence = 0;
+    FlashMode flash_mode = FlashMode::FIRMWARE;
+    const esp_partition_t *partition = nullptr;
+    size_t image_size = 0;
+    uint16_t block_size = 0;
+    uint16_t group_size = 0;
+    uint32_t block_count = 0;
+    uint32_t blocks_received = 0;
+    std::vector<uint8_t> received; // Bitmap of received blocks.
+    std::vector<uint8_t> scratch;  // For recovering blocks from parity.
+    std::string md5;
+    uint8_t skip_buffer[16]; // ENCRYPTED_BLOCK_SIZE
+    bool end_seen = false;
+    struct sockaddr_storage sender;
+    int64_t started_us = 0;
+    int64_t last_block_us = 0;
+    int64_t last_nack_us = 0;
+  };
+
+  struct MulticastState {
+    std::optional<MulticastSession> session;
+    // Session that failed or was rejected, so that its remaining packets and announcements are ignored.
+    uint32_t ignored_session_id = 0;
+  };
+
+  int openMulticastSocket(uint32_t recv_timeout_ms);
+  bool handleMulticastPacket(int sock, MulticastState &state);
+  void serviceMulticastSession(int sock, MulticastState &state);
+
+  bool beginMulticastSession(MulticastSession &session, const char *packet, size_t length, bool &busy);
+  bool writeMulticastBlock(MulticastSession &session, uint32_t index, const char *data, size_t length);
+  bool recoverMulticastBlock(MulticastSession &session, uint32_t group, const char *parity, size_t length);
+  void sendMulticastNack(int sock, MulticastSession &session);
+  bool finishMulticastSession(MulticastSession &session);
+  void endMulticastSession(MulticastSession &session, bool success);
+  bool authenticateMulticastPacket(const MulticastSession &session, const char *packet, size_t length);
+  uint32_t loadMulticastSequence();
+  bool storeMulticastSequence(uint32_t sequence);
+
+private: // On demand activation
+  static void wakeListenerTask(void *pvParameters);
+  static void deactivateTask(void *pvParameters);
+  int openWakeSocket(uint32_t recv_timeout_ms);
+  bool handleWakePacket(int sock);
+  void handleDeactivateRequest();
+
+private: // Reactor
+  static void reactorTask(void *pvParameters);
+  static void idleTimerCallback(void *arg);
+  void onActivity();
+
 private: // Rollback
   static void rollbackWatcherTask(void *pvParameters);
+  void watchHealthProbes();
+  void onHealthProbeFailed(const std::string &reason, bool pending_verify);
+
+  static constexpr uint8_t MAX_HEALTH_PROBES = 8;
+
+  struct HealthProbe {
+    std::string name;
+    uint32_t deadline_ms = 0;
+    std::atomic<int64_t> passed_us = 0;
+    std::atomic<bool> failed = false;
+  };
+
+private: // Pre-erase
+  void startPreErase();
+  void stopPreErase();
+  static void preEraseTask(void *pvParameters);
+  size_t claimPreErased(const esp_partition_t *partition);
+  size_t loadPreErased(const esp_partition_t *partition);
+  void storePreErased(const esp_partition_t *partition, size_t erased);
+
+private: // Update sessions
+  bool beginSession(UpdateSource source, TickType_t ticks_to_wait);
+  void endSession(bool success);
+  std::string sourceToString(UpdateSource source);
 
 private: // Generic utils
+  struct TaskStorage {
+    StackType_t *stack = nullptr;
+    StaticTask_t *tcb = nullptr;
+  };
+  bool reserveTaskStorage(TaskStorage &storage, uint32_t stack_size);
+  bool createTask(TaskFunction_t task, const char *name, uint32_t stack_size, UBaseType_t priority, BaseType_t core_id,
+                  TaskStorage &storage, void *parameters = nullptr);
+  char *acquireUpdateBuffer();
+  void releaseUpdateBuffer(char *buffer);
+  bool isLogEnabled(const esp_log_level_t log_level);
+  static void startupTask(void *pvParameters);
+  void logConfiguration();
+  void onServiceStarted(EventBits_t bit);
+  void notifyReady(bool ready);
+  void onStartupPhaseCompleted();
+  bool setStartupTiming(int64_t StartupTimings::*field, int64_t us);
   void reportStatus(OtaStatus status);
   bool reportOnError(esp_err_t err, const char *msg);
   void replaceAll(std::string &s, const std::string &search, const std::string &replace);
   std::string trim(const std::string &str);
+  std::string coreToString(BaseType_t core_id);
   void log(const esp_log_level_t log_level, const std::string &message);
 
 private:
@@ -280,7 +1073,65 @@ private:
   CrtBundleAttach _crt_bundle_attach;
   uint8_t _rollback_bits_to_wait_for;
   EventGroupHandle_t _rollback_event_group;
+  StaticEventGroup_t _rollback_event_group_buffer;
+  size_t _chunk_size;
+  char *_update_buffer = nullptr;
+  char *_staging_buffer = nullptr;
+  std::atomic<bool> _update_buffer_in_use = false;
+  TaskStorage _rollback_task_storage;
+  TaskStorage _arduino_ota_task_storage;
+  TaskStorage _wake_task_storage;
+  TaskStorage _multicast_ota_task_storage;
+  TaskStorage _reactor_task_storage;
+  TaskStorage _startup_task_storage;
+  TaskStorage _pre_erase_task_storage;
+  TaskStorage _staging_task_storage;
+  QueueHandle_t _staging_free_slots = nullptr; // Staging queues and semaphore, only reserved if static_allocation.
+  StaticQueue_t _staging_free_slots_buffer;
+  QueueHandle_t _staging_filled_slots = nullptr;
+  StaticQueue_t _staging_filled_slots_buffer;
+  SemaphoreHandle_t _staging_done = nullptr;
+  StaticSemaphore_t _staging_done_buffer;
+  QueueHandle_t _staging_work = nullptr; // Hands each update to the persistent staging task.
+  StaticQueue_t _staging_work_buffer;
+  StagingContext *_staging_work_storage[1];
+  bool _staging_worker_started = false;
+  SemaphoreHandle_t _activation_mutex;
+  StaticSemaphore_t _activation_mutex_buffer;
+  SemaphoreHandle_t _session_semaphore; // Binary, not a mutex, as an OtaSink session may end in another task.
+  StaticSemaphore_t _session_semaphore_buffer;
+  SemaphoreHandle_t _pre_erase_mutex; // Held for each pre-erase step.
+  StaticSemaphore_t _pre_erase_mutex_buffer;
+  std::atomic<bool> _pre_erase_started = false;
+  std::atomic<bool> _pre_erase_stop = false;
+  uint32_t _session_id = 0;
+  std::atomic<UpdateSource> _session_source = UpdateSource::NONE;
+  esp_timer_handle_t _idle_timer = nullptr;
+  httpd_handle_t _httpd_handle = nullptr;
+  std::string _remote_md5_header;
+  esp_http_client_handle_t _remote_client = nullptr; // Kept for reuse, see RemoteHttp.
+  std::string _remote_client_origin;
+  std::atomic<bool> _active = false;
+  std::atomic<bool> _update_in_progress = false;
+  std::atomic<bool> _arduino_ota_running = false;
+  std::atomic<bool> _arduino_ota_stop = false;
+  std::atomic<bool> _deactivate_requested = false; // Set by the idle timer, see handleDeactivateRequest().
+  size_t _idle_heap_usage = 0;
+  size_t _active_heap_usage = 0;
   OtaStatusCallback _ota_status_callback;
+  OnReady _ready_callback;
+  std::atomic<bool> _ready_notified = false;
+  esp_pm_lock_handle_t _pm_lock = nullptr;
+  std::optional<wifi_ps_type_t> _wifi_ps_to_restore;
+  StartupTimings _startup_timings;
+  UpdateStatistics _update_statistics;
+  size_t _erased_until = 0;
+  int64_t _flash_busy_since_yield_us = 0;
+  bool _rollback_watcher_started = false;
+  HealthProbe _health_probes[MAX_HEALTH_PROBES];
+  uint8_t _health_probe_count = 0;
+  portMUX_TYPE _startup_timings_lock = portMUX_INITIALIZER_UNLOCKED; // Set from several tasks.
+  std::atomic<bool> _startup_timings_logged = false;
 };
 
 #endif // __OTA_HELPER_H__
\ No newline at end of file
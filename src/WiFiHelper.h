@@ -1,16 +1,28 @@
 #ifndef __WIFI_HELPER_H__
 #define __WIFI_HELPER_H__
 
+#include <algorithm>
+#include <atomic>
+#include <esp_bit_defs.h>
 #include <esp_event.h>
 #include <esp_log.h>
 #include <esp_netif.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/semphr.h>
 #include <functional>
+#include <map>
 #include <string>
 #include <vector>
 
 #define TIMEOUT_CONNECT_MS 5000
+#define LINK_MONITOR_SAMPLE_INTERVAL_MS 10000
+
+// Event group bits, see WiFiHelper::getEventGroup()
+#define WIFI_HELPER_CONNECTED_BIT BIT0    // Set when connected and got IP. Cleared on disconnect.
+#define WIFI_HELPER_DISCONNECTED_BIT BIT1 // Set when not connected. Cleared once connected.
 
 namespace WiFiHelperLog {
 const char TAG[] = "WiFiHelper";
@@ -57,10 +69,53 @@ public:
                    int timeout_ms = TIMEOUT_CONNECT_MS, bool reconnect = true);
 
   /**
-   * @brief Disconnect from the AP.
+   * @brief Connect to AP without blocking.
+   *
+   * Initializes and starts WiFi and returns immediately, while association and DHCP continues in the background.
+   * Follow progress using getState(), the state callbacks (see addOnStateChanged()), the on_connected callback,
+   * or by waiting on the event group (see getEventGroup() and waitForConnection()). Unlike connectToAp(), there is
+   * no timeout, it keeps on trying until connected or disconnect() is called.
+   *
+   * Note that NVS must have been setup before calling this function. Either your application does this, or you can set
+   * initializeNVS to do it automatically.
+   *
+   * @param ssid the SSID to connect to.
+   * @param password the password to use.
+   * @param initializeNVS true to initialize NVS before connecting.
+   * @param reconnect true to reconnect on connection loss.
+   * @return true if WiFi was successfully started. Does not mean that a connection has been established.
+   */
+  bool connectToApAsync(const char *ssid, const char *password, bool initializeNVS = true, bool reconnect = true);
+
+  /**
+   * @brief Block until connected to AP and got IP, or the timeout passes.
+   *
+   * @param timeout_ms timeout in milliseconds, or portMAX_DELAY to wait forever.
+   * @return true if connected.
+   */
+  bool waitForConnection(uint32_t timeout_ms);
+
+  /**
+   * @brief Disconnect from the AP and tear down WiFi, netif and the default event loop.
    */
   void disconnect();
 
+  /**
+   * @brief Disconnect from the AP and stop the radio, but keep WiFi driver, netif, event loop and event handlers
+   * initialized, so that resume() can reconnect much faster than a new connectToAp(). Use for devices that turn off
+   * WiFi between bursts of work. Calling connectToAp()/connectToApAsync() while suspended also reuses the stack.
+   * The on_disconnected callback is called if connected. The link monitor, if started, is paused until resumed.
+   */
+  void suspend();
+
+  /**
+   * @brief Restart the radio and reconnect to the AP after suspend(), with the same credentials and reconnect
+   * setting. Does not block, see waitForConnection().
+   *
+   * @return true if WiFi was successfully restarted. Does not mean that a connection has been established.
+   */
+  bool resume();
+
   /**
    * Return IP address when connected to AP.
    */
@@ -71,6 +126,170 @@ public:
    */
   bool isConnected() { return _is_connected; }
 
+  enum class State {
+    IDLE,          // Not started, or disconnect() called.
+    ASSOCIATING,   // Connecting to AP.
+    OBTAINING_IP,  // Associated with AP, waiting for IP (DHCP).
+    CONNECTED,     // Connected and got IP.
+    BACKOFF,       // Connection failed or lost, waiting before reconnecting (see setReconnectBackoff()).
+  };
+
+  /**
+   * @brief Return the current connection state.
+   */
+  State getState() { return _state; }
+
+  /**
+   * @brief Callback on connection state change. Called from the default event loop task, or from the calling task for
+   * IDLE on disconnect()/suspend(), so do not do anything blocking.
+   *
+   * @param state the new state.
+   */
+  using OnStateChanged = std::function<void(State state)>;
+
+  /**
+   * @brief Register callback for connection state changes.
+   */
+  void addOnStateChanged(OnStateChanged on_state_changed) { _on_state_changed.push_back(on_state_changed); }
+
+  /**
+   * @brief Event group with WIFI_HELPER_CONNECTED_BIT and WIFI_HELPER_DISCONNECTED_BIT, for applications that want to
+   * wait for connection state together with other events, using xEventGroupWaitBits(). Do not set or clear any bits.
+   */
+  EventGroupHandle_t getEventGroup() { return _wifi_event_group; }
+
+  /**
+   * @brief Set delay between reconnection attempts. The delay starts at initial_delay_ms and is doubled for each
+   * failed attempt, up to max_delay_ms. Reset once connected. Default is 0, meaning reconnecting immediately.
+   * While waiting, state is BACKOFF.
+   *
+   * @param initial_delay_ms delay before the first reconnection attempt, in milliseconds.
+   * @param max_delay_ms maximum delay between reconnection attempts, in milliseconds.
+   */
+  void setReconnectBackoff(uint32_t initial_delay_ms, uint32_t max_delay_ms) {
+    _backoff_initial_ms = initial_delay_ms;
+    _backoff_max_ms = std::max(initial_delay_ms, max_delay_ms);
+  }
+
+  /**
+   * @brief Timestamps of each phase of the last connectToAp()/connectToApAsync(), in microseconds since boot
+   * (esp_timer_get_time()). 0 if the phase has not been reached (or was skipped, like NVS initialization).
+   * A one line summary is logged once IP has been acquired.
+   */
+  struct StartupTimings {
+    int64_t connect_called_us = 0;
+    int64_t nvs_initialized_us = 0;
+    int64_t netif_initialized_us = 0; // netif, default event loop and default STA netif created.
+    int64_t wifi_started_us = 0;      // esp_wifi_start() returned.
+    int64_t associated_us = 0;        // WIFI_EVENT_STA_CONNECTED.
+    int64_t got_ip_us = 0;            // IP_EVENT_STA_GOT_IP.
+  };
+
+  /**
+   * @brief Return the timings of the last connectToAp()/connectToApAsync().
+   */
+  StartupTimings getStartupTimings() { return _startup_timings; }
+
+  /**
+   * @brief Set the WiFi power save mode to use when connected. Default is WIFI_PS_MIN_MODEM (same as ESP-IDF).
+   * Can be called before or after connectToAp(). If already connected, the mode is applied immediately.
+   *
+   * Note that OtaHelper temporarily switches to WIFI_PS_NONE while writing an update (see
+   * OtaHelper::PowerManagement), and restores the mode set here once done.
+   *
+   * @param power_save_mode the power save mode, one of WIFI_PS_NONE, WIFI_PS_MIN_MODEM or WIFI_PS_MAX_MODEM.
+   */
+  void setPowerSaveMode(wifi_ps_type_t power_save_mode);
+
+  /**
+   * @brief Return the configured WiFi power save mode.
+   */
+  wifi_ps_type_t getPowerSaveMode() { return _power_save_mode; }
+
+  /**
+   * @brief Snapshot of link quality and connection statistics, see getLinkStatistics().
+   *
+   * Connection/disconnection statistics are always collected. RSSI/PHY values are only sampled while the link monitor
+   * is running (see startLinkMonitor()).
+   */
+  struct LinkStatistics {
+    bool connected = false;
+    /**
+     * Last sampled RSSI in dBm, and min/max/average over all samples. 0 if no samples yet.
+     */
+    int8_t rssi = 0;
+    int8_t rssi_min = 0;
+    int8_t rssi_max = 0;
+    int8_t rssi_average = 0;
+    uint32_t rssi_samples = 0;
+    /**
+     * Primary channel and PHY modes negotiated with the AP, at last sample.
+     */
+    uint8_t channel = 0;
+    bool phy_11b = false;
+    bool phy_11g = false;
+    bool phy_11n = false;
+    bool phy_lr = false;
+    /**
+     * Number of times an established connection was lost.
+     */
+    uint32_t connection_losses = 0;
+    /**
+     * Number of WIFI_EVENT_STA_DISCONNECTED events by reason code (wifi_err_reason_t). This includes failed connection
+     * attempts, not only lost connections.
+     */
+    std::map<uint16_t, uint32_t> disconnect_reasons;
+    /**
+     * Cumulative time connected and not connected since WiFi was started, in milliseconds.
+     */
+    uint64_t connected_time_ms = 0;
+    uint64_t disconnected_time_ms = 0;
+    /**
+     * Number of times an IP has been acquired, and time from (re)connection attempt to IP for the last attempt and
+     * the slowest attempt, in milliseconds.
+     */
+    uint32_t ip_acquisitions = 0;
+    uint32_t last_time_to_ip_ms = 0;
+    uint32_t max_time_to_ip_ms = 0;
+  };
+
+  /**
+   * @brief Callback when the sampled RSSI crosses the configured threshold (see startLinkMonitor()).
+   *
+   * @param good true if the link quality went above the threshold, false if it went below.
+   * @param statistics snapshot of the statistics at the time of crossing.
+   */
+  using OnLinkQualityChanged = std::function<void(bool good, const LinkStatistics &statistics)>;
+
+  /**
+   * @brief Start periodically sampling RSSI and PHY mode of the connected AP. Lightweight, runs on the esp_timer
+   * task. Do not do anything blocking in the callback.
+   *
+   * @param sample_interval_ms interval between samples.
+   * @param rssi_threshold_dbm RSSI threshold in dBm for the on_link_quality_changed callback.
+   * @param on_link_quality_changed optional callback when the sampled RSSI goes below the threshold, or back above
+   * the threshold plus hysteresis_db.
+   * @param hysteresis_db hysteresis in dB to avoid flapping around the threshold.
+   * @return true if the monitor was started.
+   */
+  bool startLinkMonitor(uint32_t sample_interval_ms = LINK_MONITOR_SAMPLE_INTERVAL_MS, int8_t rssi_threshold_dbm = -75,
+                        OnLinkQualityChanged on_link_quality_changed = {}, uint8_t hysteresis_db = 3);
+
+  /**
+   * @brief Stop sampling RSSI and PHY mode. Connection statistics are still collected. Also stopped by disconnect().
+   */
+  void stopLinkMonitor();
+
+  /**
+   * @brief Return a snapshot of the link quality and connection statistics.
+   */
+  LinkStatistics getLinkStatistics();
+
+  /**
+   * @brief Reset all link quality and connection statistics.
+   */
+  void resetLinkStatistics();
+
   /**
    * @brief Callback when this object want to log something.
    *
@@ -86,12 +305,25 @@ public:
    */
   void addOnLog(OnLog on_log) { _on_log.push_back(on_log); }
 
+private:
+  bool startWiFi(const char *ssid, const char *password, bool initializeNVS, bool reconnect);
+  bool initializeStack();
+  void stopWiFi();
+  void setState(State state);
+  void reconnectOrBackoff();
+  void logStartupTimings();
+  static void backoffTimerCallback(void *arg);
+
 private:
   bool initializeNVS();
   bool reportOnError(esp_err_t err, const char *msg);
 
 private:
   static void eventHandler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
+  static void linkMonitorCallback(void *arg);
+  void onConnectAttempt();
+  void onConnectionStateChanged(bool connected);
+  void resumeLinkMonitor();
   void log(const esp_log_level_t log_level, const std::string &message);
 
 private:
@@ -99,13 +331,42 @@ private:
 
 private:
   bool _reconnect;
+  bool _reconnect_on_resume = true;
   bool _is_connected;
+  bool _wifi_started = false;
+  bool _stack_initialized = false;
+  esp_event_handler_instance_t _instance_any_id;
+  esp_event_handler_instance_t _instance_got_ip;
+  esp_event_handler_instance_t _instance_backoff;
+  wifi_ps_type_t _power_save_mode = WIFI_PS_MIN_MODEM;
   esp_ip4_addr_t _ip_addr;
   esp_netif_t *_netif_sta;
   std::vector<OnLog> _on_log;
   EventGroupHandle_t _wifi_event_group;
   std::function<void(void)> _on_connected;
   std::function<void(void)> _on_disconnected;
+
+private: // State
+  std::atomic<State> _state = State::IDLE; // Only changed on the event loop task, except by stopWiFi().
+  std::vector<OnStateChanged> _on_state_changed;
+  esp_timer_handle_t _backoff_timer = nullptr;
+  uint32_t _backoff_initial_ms = 0;
+  uint32_t _backoff_max_ms = 0;
+  uint32_t _backoff_next_ms = 0;
+  StartupTimings _startup_timings;
+
+private: // Link statistics
+  SemaphoreHandle_t _statistics_mutex;
+  LinkStatistics _statistics;
+  int64_t _rssi_sum = 0;
+  int64_t _state_since_us = 0;
+  int64_t _connect_attempt_us = 0;
+  esp_timer_handle_t _link_monitor_timer = nullptr;
+  uint32_t _link_monitor_interval_ms = 0;
+  int8_t _rssi_threshold_dbm;
+  uint8_t _rssi_hysteresis_db;
+  bool _link_quality_good = true;
+  OnLinkQualityChanged _on_link_quality_changed;
 };
 
 #endif // __WIFI_HELPER_H__
\ No newline at end of file
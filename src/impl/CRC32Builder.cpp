@@ -0,0 +1,21 @@
+#include "CRC32Builder.h"
+#include <cstring>
+#include <esp_rom_crc.h>
+
+namespace ConnectionHelperUtils {
+
+void CRC32Builder::begin() {
+  std::memset(_buf, 0x00, CRC32_DIGEST_LEN);
+  _crc = 0;
+}
+
+void CRC32Builder::add(const uint8_t *data, size_t len) { _crc = esp_rom_crc32_le(_crc, data, len); }
+
+void CRC32Builder::calculate() {
+  _buf[0] = (uint8_t)(_crc >> 24);
+  _buf[1] = (uint8_t)(_crc >> 16);
+  _buf[2] = (uint8_t)(_crc >> 8);
+  _buf[3] = (uint8_t)_crc;
+}
+
+} // namespace ConnectionHelperUtils
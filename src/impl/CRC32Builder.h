@@ -0,0 +1,35 @@
+#ifndef __CRC32_BUILDER__
+#define __CRC32_BUILDER__
+
+#include "Hasher.h"
+
+#define CRC32_DIGEST_LEN 4
+
+namespace ConnectionHelperUtils {
+
+/**
+ * @brief CRC32 (IEEE 802.3, little endian, same as zlib), using the ROM implementation.
+ * The digest is the CRC in big endian byte order, so that toString() matches the usual hex notation.
+ */
+class CRC32Builder : public Hasher {
+public:
+  using Hasher::add;
+  void begin() override;
+  void add(const uint8_t *data, size_t len) override;
+  void calculate() override;
+  const uint8_t *digest() const override { return _buf; }
+  size_t digestLength() const override { return CRC32_DIGEST_LEN; }
+
+  /**
+   * @brief The CRC as an integer, valid after calculate().
+   */
+  uint32_t value() const { return _crc; }
+
+private:
+  uint32_t _crc;
+  uint8_t _buf[CRC32_DIGEST_LEN];
+};
+
+} // namespace ConnectionHelperUtils
+
+#endif // __CRC32_BUILDER__
@@ -0,0 +1,96 @@
+#include "ChunkedDecoder.h"
+#include <algorithm>
+#include <cstring>
+
+namespace ConnectionHelperUtils {
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+size_t ChunkedDecoder::decode(char *data, size_t len) {
+  size_t out = 0;
+  size_t i = 0;
+  while (i < len && _state != State::DONE && _state != State::FAILED) {
+    char c = data[i];
+    switch (_state) {
+    case State::SIZE: {
+      int value = hexValue(c);
+      if (value >= 0) {
+        if (_chunk_left > (SIZE_MAX >> 4)) {
+          _state = State::FAILED; // Overflow
+        } else {
+          _chunk_left = (_chunk_left << 4) | value;
+          _has_size_digits = true;
+        }
+      } else if (!_has_size_digits) {
+        _state = State::FAILED;
+      } else if (c == ';' || c == ' ' || c == '\t') {
+        _state = State::SIZE_EXTENSION;
+      } else if (c == '\r') {
+        _state = State::SIZE_LF;
+      } else {
+        _state = State::FAILED;
+      }
+      i++;
+      break;
+    }
+    case State::SIZE_EXTENSION:
+      if (c == '\r') {
+        _state = State::SIZE_LF;
+      }
+      i++;
+      break;
+    case State::SIZE_LF:
+      _state = c != '\n' ? State::FAILED : (_chunk_left == 0 ? State::TRAILER_START : State::DATA);
+      i++;
+      break;
+    case State::DATA: {
+      size_t n = std::min(len - i, _chunk_left);
+      memmove(data + out, data + i, n);
+      out += n;
+      i += n;
+      _chunk_left -= n;
+      if (_chunk_left == 0) {
+        _state = State::DATA_CR;
+      }
+      break;
+    }
+    case State::DATA_CR:
+      _state = c == '\r' ? State::DATA_LF : State::FAILED;
+      i++;
+      break;
+    case State::DATA_LF:
+      _state = c == '\n' ? State::SIZE : State::FAILED;
+      _has_size_digits = false;
+      i++;
+      break;
+    case State::TRAILER_START:
+      _state = c == '\r' ? State::FINAL_LF : State::TRAILER;
+      i++;
+      break;
+    case State::TRAILER:
+      if (c == '\n') {
+        _state = State::TRAILER_START;
+      }
+      i++;
+      break;
+    case State::FINAL_LF:
+      _state = c == '\n' ? State::DONE : State::FAILED;
+      i++;
+      break;
+    default:
+      break;
+    }
+  }
+  return out;
+}
+
+} // namespace ConnectionHelperUtils
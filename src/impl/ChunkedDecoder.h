@@ -0,0 +1,56 @@
+#ifndef __CHUNKED_DECODER__
+#define __CHUNKED_DECODER__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ConnectionHelperUtils {
+
+/**
+ * @brief Incremental decoder for HTTP/1.1 chunked transfer encoding (RFC 9112, section 7.1).
+ *
+ * Usage: feed raw body data as it arrives to decode(), which removes the chunk framing in place. Chunk extensions and
+ * trailers are ignored. Decoding stops at the end of the last chunk, see done().
+ */
+class ChunkedDecoder {
+public:
+  /**
+   * @brief Decode data in place.
+   *
+   * @return number of payload bytes now at the start of data. Can be 0 if data only contained framing.
+   */
+  size_t decode(char *data, size_t len);
+
+  /**
+   * @brief True once the last (zero size) chunk and the trailers have been decoded.
+   */
+  bool done() const { return _state == State::DONE; }
+
+  /**
+   * @brief True if the data is not valid chunked encoding.
+   */
+  bool failed() const { return _state == State::FAILED; }
+
+private:
+  enum class State {
+    SIZE,
+    SIZE_EXTENSION,
+    SIZE_LF,
+    DATA,
+    DATA_CR,
+    DATA_LF,
+    TRAILER_START,
+    TRAILER,
+    FINAL_LF,
+    DONE,
+    FAILED,
+  };
+
+  State _state = State::SIZE;
+  size_t _chunk_left = 0;
+  bool _has_size_digits = false;
+};
+
+} // namespace ConnectionHelperUtils
+
+#endif // __CHUNKED_DECODER__
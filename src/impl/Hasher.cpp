@@ -0,0 +1,58 @@
+#include "Hasher.h"
+
+namespace ConnectionHelperUtils {
+
+static const char HEX_CHARS[] = "0123456789abcdef";
+
+void toHex(const uint8_t *data, size_t len, char *output) {
+  for (size_t i = 0; i < len; i++) {
+    output[i * 2] = HEX_CHARS[data[i] >> 4];
+    output[i * 2 + 1] = HEX_CHARS[data[i] & 0x0F];
+  }
+  output[len * 2] = '\0';
+}
+
+bool constantTimeEquals(const uint8_t *a, const uint8_t *b, size_t len) {
+  uint8_t diff = 0;
+  for (size_t i = 0; i < len; i++) {
+    diff |= a[i] ^ b[i];
+  }
+  return diff == 0;
+}
+
+void Hasher::getChars(char *output) const { toHex(digest(), digestLength(), output); }
+
+std::string Hasher::toString() const {
+  std::string out(digestLength() * 2 + 1, '\0');
+  toHex(digest(), digestLength(), out.data());
+  out.resize(digestLength() * 2); // Drop the terminator written by toHex().
+  return out;
+}
+
+/**
+ * @brief Value of a hex digit (either case) without branching, with bit 8 set if c is not a hex digit.
+ */
+static unsigned int hexValue(uint8_t c) {
+  int digit = c - '0';
+  int letter = (c | 0x20) - 'a';
+  // (x | (max - x)) is negative exactly when x is outside [0, max], and the arithmetic shift spreads the sign.
+  int digit_ok = ~((digit | (9 - digit)) >> 8);
+  int letter_ok = ~((letter | (5 - letter)) >> 8);
+  return (unsigned int)((digit & digit_ok) | ((letter + 10) & letter_ok) | (~(digit_ok | letter_ok) & 0x100));
+}
+
+bool Hasher::equals(std::string_view hex) const {
+  auto len = digestLength();
+  if (hex.size() != len * 2) {
+    return false;
+  }
+  auto *data = digest();
+  unsigned int diff = 0;
+  for (size_t i = 0; i < len; i++) {
+    diff |= hexValue(hex[i * 2]) ^ (data[i] >> 4);
+    diff |= hexValue(hex[i * 2 + 1]) ^ (data[i] & 0x0F);
+  }
+  return diff == 0;
+}
+
+} // namespace ConnectionHelperUtils
@@ -0,0 +1,59 @@
+#ifndef __HASHER__
+#define __HASHER__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace ConnectionHelperUtils {
+
+/**
+ * @brief Base for streaming hashes/checksums (see MD5Builder, SHA256Builder and CRC32Builder).
+ *
+ * Usage: begin(), add() any number of times, calculate(), then read the digest using digest(), toString() or
+ * equals().
+ */
+class Hasher {
+public:
+  virtual ~Hasher() = default;
+
+  virtual void begin() = 0;
+  virtual void add(const uint8_t *data, size_t len) = 0;
+  void add(std::string_view str) { add((const uint8_t *)str.data(), str.size()); }
+  virtual void calculate() = 0;
+
+  /**
+   * @brief The raw digest, valid after calculate(). Of length digestLength().
+   */
+  virtual const uint8_t *digest() const = 0;
+  virtual size_t digestLength() const = 0;
+
+  /**
+   * @brief Write digest as lowercase hex string to output. Output must fit digestLength() * 2 + 1 characters.
+   */
+  void getChars(char *output) const;
+  std::string toString() const;
+
+  /**
+   * @brief Compare digest against a hex string (upper or lower case) in constant time, to not leak timing information
+   * when comparing secrets.
+   *
+   * @return true if equal.
+   */
+  bool equals(std::string_view hex) const;
+};
+
+/**
+ * @brief Encode data as lowercase hex string to output. Output must fit len * 2 + 1 characters.
+ */
+void toHex(const uint8_t *data, size_t len, char *output);
+
+/**
+ * @brief Compare two buffers in constant time (for the given length).
+ */
+bool constantTimeEquals(const uint8_t *a, const uint8_t *b, size_t len);
+
+} // namespace ConnectionHelperUtils
+
+#endif // __HASHER__
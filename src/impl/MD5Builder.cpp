@@ -26,22 +26,8 @@ void MD5Builder::begin() {
   esp_rom_md5_init(&_ctx);
 }
 
-void MD5Builder::add(std::string str) { add((uint8_t *)str.c_str(), (uint16_t)str.length()); }
-
-void MD5Builder::add(uint8_t *data, uint16_t len) { esp_rom_md5_update(&_ctx, data, len); }
+void MD5Builder::add(const uint8_t *data, size_t len) { esp_rom_md5_update(&_ctx, data, len); }
 
 void MD5Builder::calculate() { esp_rom_md5_final(_buf, &_ctx); }
 
-void MD5Builder::getChars(char *output) {
-  for (uint8_t i = 0; i < ESP_ROM_MD5_DIGEST_LEN; i++) {
-    sprintf(output + (i * 2), "%02x", _buf[i]);
-  }
-}
-
-std::string MD5Builder::toString() {
-  char out[(ESP_ROM_MD5_DIGEST_LEN * 2) + 1];
-  getChars(out);
-  return std::string(out);
-}
-
 } // namespace ConnectionHelperUtils
\ No newline at end of file
@@ -19,20 +19,21 @@
 #ifndef __MD5_BUILDER__
 #define __MD5_BUILDER__
 
+#include "Hasher.h"
 #include <esp_rom_md5.h>
 #include <esp_system.h>
 #include <string>
 
 namespace ConnectionHelperUtils {
 
-class MD5Builder {
+class MD5Builder : public Hasher {
 public:
-  void begin();
-  void add(uint8_t *data, uint16_t len);
-  void add(std::string str);
-  void calculate();
-  void getChars(char *output);
-  std::string toString();
+  using Hasher::add;
+  void begin() override;
+  void add(const uint8_t *data, size_t len) override;
+  void calculate() override;
+  const uint8_t *digest() const override { return _buf; }
+  size_t digestLength() const override { return ESP_ROM_MD5_DIGEST_LEN; }
 
 private:
   md5_context_t _ctx;
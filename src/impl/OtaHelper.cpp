@@ -1,18 +1,28 @@
 #include "OtaHelper.h"
+#include "ChunkedDecoder.h"
 #include "LogHelper.h"
 #include "MD5Builder.h"
+#include "SHA256Builder.h"
 #include "ota_html.h"
 #include <esp_app_format.h>
+#include <esp_chip_info.h>
+#include <esp_efuse.h>
+#include <esp_heap_caps.h>
+#include <esp_image_format.h>
 #include <esp_log.h>
 #include <esp_ota_ops.h>
 #include <esp_timer.h>
 #include <esp_tls_crypto.h>
 #include <lwip/sockets.h>
 #include <lwip/sys.h>
+#include <nvs.h>
+#include <new>
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 4, 0)
 #include <esp_flash_spi_init.h>
 #endif
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include <esp_app_desc.h>
+#include <esp_random.h>
 #include <spi_flash_mmap.h>
 #endif
 
@@ -21,28 +31,136 @@
 #define UDP_CMD_WRITE_SPIFFS 100
 #define UDP_CMD_AUTH 200
 #define ESPOTA_SUCCESSFUL "OK"
-#define ARDUINO_OTA_TASK_STACK_SIZE 4096
+#define ESPOTA_BUSY "ERR Update already in progress"
 
 // Web OTA/HTTP local OTA specific
 #define AUTHORIZATION_HDR_KEY "Authorization"
+#define AUTHORIZATION_MAX_LEN 512
+#define AUTH_REALM "OtaHelper"
+#define DIGEST_NONCE_LIFETIME_MS (60 * 60 * 1000)
+#define SESSION_COOKIE_NAME "ota_session"
 #define FLASH_MODE_HDR_KEY "X-Flash-Mode"
+#define TRANSFER_ENCODING_HDR_KEY "Transfer-Encoding"
+#define EXPECT_HDR_KEY "Expect"
+#define HTTP_100_CONTINUE "HTTP/1.1 100 Continue\r\n\r\n"
+#define FIRMWARE_URI "/firmware"
+#define IMAGE_MD5_HDR_KEY "X-Image-MD5"
+#define SERVE_SLICE_SIZE (4 * SPI_FLASH_SEC_SIZE)
 #define FLASH_MODE_FIRMWARE_STR "firmware"
 #define FLASH_MODE_SPIFFS_STR "spiffs"
 #define HTTPD_401 "401 UNAUTHORIZED"
+#define HTTPD_503 "503 Service Unavailable"
+#define HTTPD_417 "417 Expectation Failed"
 
-// HTTP remote OTA specifc
-#define HTTP_REMOTE_TIMEOUT_MS 15000
+// Remote URI specific
+#define REDIRECT_URL_MAX_LEN 512
 
 // generic partition
 #define ENCRYPTED_BLOCK_SIZE 16
-#define SPI_SECTORS_PER_BLOCK 16 // usually large erase block is 32k/64k
-#define SPI_FLASH_BLOCK_SIZE (SPI_SECTORS_PER_BLOCK * SPI_FLASH_SEC_SIZE)
+#define MMAP_WINDOW_SIZE (4 * SPI_FLASH_MMU_PAGE_SIZE)
+#define MAX_CHUNK_SIZE (16 * SPI_FLASH_SEC_SIZE)
+
+// On demand activation specific
+#define WAKE_PACKET "WAKE"
+#define WAKE_REPLY_OK "OK"
+#define WAKE_REPLY_FAILED "FAILED"
+#define ARDUINO_OTA_RECV_TIMEOUT_MS 1000
+#define WAKE_RECV_TIMEOUT_MS 1000
+
+// Multicast OTA specific, see multicast_upload.py for the sender side
+#define MULTICAST_MAGIC 0x4D41544F // "OTAM"
+#define MULTICAST_ANNOUNCE 1
+#define MULTICAST_DATA 2
+#define MULTICAST_PARITY 3
+#define MULTICAST_END 4
+#define MULTICAST_NACK 5
+#define MULTICAST_MIN_BLOCK_SIZE 512
+#define MULTICAST_MAX_BLOCK_SIZE 1408
+#define MULTICAST_MAX_GROUP_SIZE 64
+#define MULTICAST_MAX_NACK_BLOCKS 256
+#define MULTICAST_NACK_INTERVAL_MS 500
+#define MULTICAST_RECV_TIMEOUT_MS 100
+#define MULTICAST_TAG_LEN 16
+#define MULTICAST_NVS_NAMESPACE "ota_helper"
+#define MULTICAST_NVS_SEQUENCE_KEY "mcast_seq"
+
+// Reactor specific
+#define REACTOR_TICK_MS 100
 
 // Rollback related
 #define ARDUINO_OTA_STARTED_BIT BIT0
 #define WEB_OTA_STARTED_BIT BIT1
-#define ROLLBACK_TASK_STACK_SIZE 2048
-#define ROLLBACK_TASK_PRIORITY 5
+#define WAKE_LISTENER_STARTED_BIT BIT2
+#define MULTICAST_OTA_STARTED_BIT BIT3
+// Not cleared in start(), as probes can report before.
+#define HEALTH_PROBE_BIT(probe_id) (1 << (8 + (probe_id)))
+#define HEALTH_PROBE_FAILED_BIT BIT16
+
+// Pre-erase related
+#define PRE_ERASE_NVS_NAMESPACE "ota_helper"
+#define PRE_ERASE_NVS_ADDRESS_KEY "erase_addr"
+#define PRE_ERASE_NVS_LENGTH_KEY "erase_len"
+#define PRE_ERASE_PERSIST_INTERVAL (64 * 1024)
+
+namespace {
+// All fields little endian, as on both ends.
+struct __attribute__((packed)) MulticastHeader {
+  uint32_t magic;
+  uint8_t type;
+  uint8_t flash_mode; // 0 for firmware, 1 for spiffs.
+  uint16_t block_size;
+  uint32_t session_id;
+  uint32_t index; // Block index for data, group index for parity.
+};
+
+struct __attribute__((packed)) MulticastAnnounce {
+  uint32_t image_size;
+  uint16_t group_size;
+  uint16_t reserved;
+  uint32_t sequence; // Increases with each transmission (unix time by default), see Configuration::MulticastOta.
+  char md5[32];      // MD5 of the image, hex.
+  char token[32];    // Tag of header and announcement up to here, hex. Zeroes if no password.
+};
+
+/**
+ * @brief HMAC-SHA256 of the concatenated parts using password as key, truncated to MULTICAST_TAG_LEN.
+ */
+void multicastTag(const std::string &password, std::initializer_list<std::string_view> parts,
+                  uint8_t (&tag)[MULTICAST_TAG_LEN]) {
+  uint8_t key[64] = {}; // SHA-256 block size.
+  if (password.size() > sizeof(key)) {
+    ConnectionHelperUtils::SHA256Builder hash;
+    hash.begin();
+    hash.add(password);
+    hash.calculate();
+    memcpy(key, hash.digest(), hash.digestLength());
+  } else {
+    memcpy(key, password.data(), password.size());
+  }
+
+  uint8_t pad[sizeof(key)];
+  for (size_t i = 0; i < sizeof(key); i++) {
+    pad[i] = key[i] ^ 0x36;
+  }
+  ConnectionHelperUtils::SHA256Builder inner;
+  inner.begin();
+  inner.add(pad, sizeof(pad));
+  for (auto &part : parts) {
+    inner.add(part);
+  }
+  inner.calculate();
+
+  for (size_t i = 0; i < sizeof(key); i++) {
+    pad[i] = key[i] ^ 0x5c;
+  }
+  ConnectionHelperUtils::SHA256Builder outer;
+  outer.begin();
+  outer.add(pad, sizeof(pad));
+  outer.add(inner.digest(), inner.digestLength());
+  outer.calculate();
+  memcpy(tag, outer.digest(), MULTICAST_TAG_LEN);
+}
+} // namespace
 
 // #########################################################################
 // Public API
@@ -51,79 +169,225 @@
 OtaHelper::OtaHelper(Configuration configuration, CrtBundleAttach crt_bundle_attach,
                      OtaStatusCallback ota_status_callback)
     : _configuration(configuration), _crt_bundle_attach(crt_bundle_attach), _ota_status_callback(ota_status_callback) {
-  _rollback_event_group = xEventGroupCreate();
+  _rollback_event_group = xEventGroupCreateStatic(&_rollback_event_group_buffer);
+  _activation_mutex = xSemaphoreCreateMutexStatic(&_activation_mutex_buffer);
+  _session_semaphore = xSemaphoreCreateBinaryStatic(&_session_semaphore_buffer);
+  xSemaphoreGive(_session_semaphore);
+  _pre_erase_mutex = xSemaphoreCreateMutexStatic(&_pre_erase_mutex_buffer);
+  _chunk_size = std::clamp((size_t)_configuration.transfer.chunk_size / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE,
+                           (size_t)SPI_FLASH_SEC_SIZE, (size_t)MAX_CHUNK_SIZE);
+
+  if (_configuration.static_allocation) {
+    _update_buffer = (char *)heap_caps_malloc(_chunk_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (_update_buffer == nullptr) {
+      log(ESP_LOG_ERROR, "Failed to reserve update buffer of size " + std::to_string(_chunk_size));
+    }
+    if (_configuration.rollback_strategy == RollbackStrategy::AUTO) {
+      reserveTaskStorage(_rollback_task_storage, _configuration.rollback_task_stack_size);
+    }
+    if (_configuration.reactor.enabled) {
+      reserveTaskStorage(_reactor_task_storage, _configuration.reactor.task_stack_size);
+    } else {
+      if (_configuration.on_demand.enabled) {
+        if (_configuration.on_demand.wake_udp_port != 0) {
+          reserveTaskStorage(_wake_task_storage, _configuration.on_demand.wake_task_stack_size);
+        }
+      } else if (_configuration.arduino_ota.enabled) {
+        reserveTaskStorage(_arduino_ota_task_storage, _configuration.arduino_ota.task_stack_size);
+      }
+      if (_configuration.multicast_ota.enabled) {
+        reserveTaskStorage(_multicast_ota_task_storage, _configuration.multicast_ota.task_stack_size);
+      }
+    }
+    if (_configuration.startup.async && _configuration.web_ota.enabled && !_configuration.on_demand.enabled) {
+      reserveTaskStorage(_startup_task_storage, _configuration.startup.task_stack_size);
+    }
+    if (_configuration.pre_erase.enabled) {
+      reserveTaskStorage(_pre_erase_task_storage, _configuration.pre_erase.task_stack_size);
+    }
+    size_t staging_slots = _configuration.staging.size / _chunk_size;
+    if (staging_slots >= 2) {
+      _staging_buffer = allocateStagingBuffer(staging_slots * _chunk_size);
+      reserveTaskStorage(_staging_task_storage, _configuration.staging.task_stack_size);
+      reserveStagingQueues(staging_slots);
+    }
+  }
 }
 
 bool OtaHelper::start() {
+  portENTER_CRITICAL(&_startup_timings_lock);
+  _startup_timings = {};
+  _startup_timings.start_called_us = esp_timer_get_time();
+  portEXIT_CRITICAL(&_startup_timings_lock);
+  _startup_timings_logged = false;
+  _rollback_watcher_started = false;
+  _ready_notified = false;
 
   _rollback_bits_to_wait_for = 0;
   xEventGroupClearBits(_rollback_event_group, 0xFF);
 
   // Username cleanup
   _configuration.web_ota.credentials.username = trim(_configuration.web_ota.credentials.username);
+  prepareAuthentication();
 
-  log(ESP_LOG_INFO, "Starting OtaHelper with the following configuration");
-  log(ESP_LOG_INFO, "  - Rollback Strategy: " +
-                        std::string(_configuration.rollback_strategy == RollbackStrategy::AUTO ? "auto" : "manual"));
-  if (_configuration.rollback_strategy == RollbackStrategy::AUTO) {
-    log(ESP_LOG_INFO, "  - Rollback Timeout: " + std::to_string(_configuration.rollback_timeout_ms) + "ms");
-  }
-
-  log(ESP_LOG_INFO, "  - Web UI/OTA: " + std::string(_configuration.web_ota.enabled ? "enabled" : "disabled"));
   if (_configuration.web_ota.enabled) {
-    log(ESP_LOG_INFO, "    - http port: " + std::to_string(_configuration.web_ota.http_port));
-    log(ESP_LOG_INFO, "    - id: " + _configuration.web_ota.id);
-    auto username = _configuration.web_ota.credentials.username;
-    if (!username.empty()) {
-      log(ESP_LOG_INFO, "    - username: " + _configuration.web_ota.credentials.username);
-    }
-    _rollback_bits_to_wait_for += WEB_OTA_STARTED_BIT;
+    _rollback_bits_to_wait_for |= WEB_OTA_STARTED_BIT;
   }
-
-  log(ESP_LOG_INFO, "  - Arduino OTA: " + std::string(_configuration.arduino_ota.enabled ? "enabled" : "disabled"));
   if (_configuration.arduino_ota.enabled) {
-    log(ESP_LOG_INFO, "    - UDP listenting port: " + std::to_string(_configuration.arduino_ota.udp_listenting_port));
-    auto password = _configuration.arduino_ota.password;
-    if (!password.empty()) {
-      log(ESP_LOG_INFO, "    - auth: enabled");
-    }
-    log(ESP_LOG_INFO, "    - UDP task priority: " + std::to_string(_configuration.arduino_ota.task_priority));
-
-    _rollback_bits_to_wait_for += ARDUINO_OTA_STARTED_BIT;
+    _rollback_bits_to_wait_for |= ARDUINO_OTA_STARTED_BIT;
+  }
+  if (_configuration.on_demand.enabled) {
+    // Services are not started until activated, so only wait for the wake listener (if any) before confirming.
+    _rollback_bits_to_wait_for = _configuration.on_demand.wake_udp_port != 0 ? WAKE_LISTENER_STARTED_BIT : 0;
+  }
+  if (_configuration.multicast_ota.enabled) {
+    _rollback_bits_to_wait_for |= MULTICAST_OTA_STARTED_BIT;
   }
 
-  log(ESP_LOG_INFO, "  - Remote URI download: enabled (always)");
+  logConfiguration();
 
   if (_configuration.rollback_strategy == RollbackStrategy::AUTO) {
     auto can_rollback = esp_ota_check_rollback_is_possible();
     if (can_rollback) {
-      log(ESP_LOG_INFO,
-          "Starting rollback task with timeout " + std::to_string(_configuration.rollback_timeout_ms) + "ms");
-      xTaskCreate(rollbackWatcherTask, "rollback", ROLLBACK_TASK_STACK_SIZE, this, ROLLBACK_TASK_PRIORITY, NULL);
+      _rollback_watcher_started = true;
+      createTask(rollbackWatcherTask, "rollback", _configuration.rollback_task_stack_size,
+                 _configuration.rollback_task_priority, _configuration.rollback_task_core_id, _rollback_task_storage);
     } else {
       log(ESP_LOG_INFO, "Not starting rollback watcher as there is no other app to rollback to or "
                         "CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE is not enabled in sdkconfig.");
     }
   }
 
-  if (_configuration.arduino_ota.enabled) {
-    xTaskCreate(arduinoOtaUdpServerTask, "arduino_udp", ARDUINO_OTA_TASK_STACK_SIZE, this,
-                _configuration.arduino_ota.task_priority, NULL);
+  // If pending verification, pre-erase starts once confirmed in cancelRollback().
+  esp_ota_img_states_t running_state;
+  if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &running_state) != ESP_OK ||
+      running_state != ESP_OTA_IMG_PENDING_VERIFY) {
+    startPreErase();
   }
 
-  bool success = !_configuration.web_ota.enabled || startWebserver();
+  bool success = true;
+  // With the reactor, one task serves all UDP listeners and opens the ArduinoOTA socket on activation.
+  bool reactor = _configuration.reactor.enabled;
+  if (reactor) {
+    success = createTask(reactorTask, "ota_reactor", _configuration.reactor.task_stack_size,
+                         _configuration.reactor.task_priority, _configuration.reactor.task_core_id,
+                         _reactor_task_storage);
+  } else if (_configuration.multicast_ota.enabled) {
+    success = createTask(multicastOtaTask, "ota_multicast", _configuration.multicast_ota.task_stack_size,
+                         _configuration.multicast_ota.task_priority, _configuration.multicast_ota.task_core_id,
+                         _multicast_ota_task_storage);
+  }
+
+  size_t free_heap_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  if (_configuration.on_demand.enabled) {
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = &idleTimerCallback;
+    timer_args.arg = this;
+    timer_args.name = "ota_idle";
+    success = reportOnError(esp_timer_create(&timer_args, &_idle_timer), "failed to create idle timer") && success;
+    if (success && !reactor && _configuration.on_demand.wake_udp_port != 0) {
+      success = createTask(wakeListenerTask, "ota_wake", _configuration.on_demand.wake_task_stack_size,
+                           _configuration.on_demand.wake_task_priority, _configuration.on_demand.wake_task_core_id,
+                           _wake_task_storage);
+    }
+    size_t free_heap_after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    _idle_heap_usage = free_heap_before > free_heap_after ? free_heap_before - free_heap_after : 0;
+    log(ESP_LOG_INFO, "OTA services idle until activated, using ~" + std::to_string(_idle_heap_usage) + " bytes heap");
+  } else {
+    if (!reactor && _configuration.arduino_ota.enabled) {
+      _arduino_ota_running = true;
+      if (!createTask(arduinoOtaUdpServerTask, "arduino_udp", _configuration.arduino_ota.task_stack_size,
+                      _configuration.arduino_ota.task_priority, _configuration.arduino_ota.task_core_id,
+                      _arduino_ota_task_storage)) {
+        _arduino_ota_running = false;
+      }
+    }
+
+    if (_configuration.web_ota.enabled && _configuration.startup.async) {
+      // Bind the UDP sockets and start httpd in parallel, without blocking the caller.
+      success = createTask(startupTask, "ota_startup", _configuration.startup.task_stack_size,
+                           _configuration.startup.task_priority, _configuration.startup.task_core_id,
+                           _startup_task_storage) &&
+                success;
+    } else if (_configuration.web_ota.enabled && !startWebserver()) {
+      notifyReady(false);
+      success = false;
+    }
+    _active = true;
+    // Not including httpd if started in the background.
+    size_t free_heap_after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    _active_heap_usage = free_heap_before > free_heap_after ? free_heap_before - free_heap_after : 0;
+  }
+  if (!success) {
+    notifyReady(false);
+  } else if ((xEventGroupGetBits(_rollback_event_group) & _rollback_bits_to_wait_for) == _rollback_bits_to_wait_for) {
+    notifyReady(true);
+  }
+  setStartupTiming(&StartupTimings::start_returned_us, esp_timer_get_time());
+  onStartupPhaseCompleted();
   return success;
 }
 
+void OtaHelper::startupTask(void *pvParameters) {
+  OtaHelper *_this = (OtaHelper *)pvParameters;
+  if (!_this->startWebserver()) {
+    _this->notifyReady(false);
+  }
+  vTaskDelete(NULL);
+}
+
 void OtaHelper::cancelRollback() {
   if (!esp_ota_check_rollback_is_possible()) {
     ESP_LOGI(OtaHelperLog::TAG, "No rollback to cancel.");
   } else {
     log(ESP_LOG_INFO, "Canceling rollback and accepting the new firmware (if firmware where written)");
     esp_ota_mark_app_valid_cancel_rollback();
+    if (setStartupTiming(&StartupTimings::rollback_confirmed_us, esp_timer_get_time())) {
+      onStartupPhaseCompleted();
+    }
+    startPreErase();
   }
 }
 
+int OtaHelper::addHealthProbe(const std::string &name, uint32_t deadline_ms) {
+  if (_startup_timings.start_called_us > 0 || _health_probe_count >= MAX_HEALTH_PROBES) {
+    log(ESP_LOG_ERROR, "Cannot add health probe " + name + ", already started or too many probes");
+    return -1;
+  }
+  auto &probe = _health_probes[_health_probe_count];
+  probe.name = name;
+  probe.deadline_ms = deadline_ms;
+  return _health_probe_count++;
+}
+
+void OtaHelper::reportHealth(int probe_id, bool healthy) {
+  if (probe_id < 0 || probe_id >= _health_probe_count) {
+    return;
+  }
+  auto &probe = _health_probes[probe_id];
+  if (probe.passed_us > 0) {
+    return;
+  }
+  if (healthy) {
+    probe.passed_us = esp_timer_get_time();
+    log(ESP_LOG_INFO, "Health probe " + probe.name + " passed");
+    xEventGroupSetBits(_rollback_event_group, HEALTH_PROBE_BIT(probe_id));
+  } else if (!probe.failed) {
+    probe.failed = true;
+    log(ESP_LOG_WARN, "Health probe " + probe.name + " failed");
+    xEventGroupSetBits(_rollback_event_group, HEALTH_PROBE_FAILED_BIT);
+  }
+}
+
+std::vector<OtaHelper::HealthProbeStatus> OtaHelper::getHealthProbes() {
+  std::vector<HealthProbeStatus> probes;
+  for (uint8_t i = 0; i < _health_probe_count; ++i) {
+    auto &probe = _health_probes[i];
+    probes.push_back({probe.name, probe.deadline_ms, probe.passed_us, probe.failed});
+  }
+  return probes;
+}
+
 bool OtaHelper::updateFrom(std::string &url, FlashMode flash_mode, std::string md5_hash) {
   auto *partition = findPartition(flash_mode);
   if (partition == nullptr) {
@@ -136,6 +400,12 @@ bool OtaHelper::updateFrom(std::string &url, FlashMode flash_mode, std::string m
     return false;
   }
 
+  auto &arbitration = _configuration.arbitration;
+  auto ticks_to_wait = arbitration.queue_pull_requests ? pdMS_TO_TICKS(arbitration.pull_queue_timeout_ms) : 0;
+  if (!beginSession(UpdateSource::REMOTE_HTTP, ticks_to_wait)) {
+    return false;
+  }
+
   reportStatus(OtaStatus::UPDATE_STARTED);
   log(ESP_LOG_INFO, "OTA started via remoteHTTP with target partition: " + std::string(partition->label));
 
@@ -145,6 +415,7 @@ bool OtaHelper::updateFrom(std::string &url, FlashMode flash_mode, std::string m
   } else {
     reportStatus(OtaStatus::UPDATE_FAILED);
   }
+  endSession(success);
   return success;
 }
 
@@ -152,55 +423,281 @@ bool OtaHelper::updateFrom(std::string &url, FlashMode flash_mode, std::string m
 // OTA via local HTTP webserver / web UI
 // #########################################################################
 
-void OtaHelper::setNotAuthenticatedResonse(httpd_req_t *req) {
+void OtaHelper::setNotAuthenticatedResonse(httpd_req_t *req, bool stale_nonce) {
   httpd_resp_set_status(req, HTTPD_401);
   httpd_resp_set_hdr(req, "Connection", "keep-alive");
-  httpd_resp_set_hdr(req, "WWW-Authenticate", "Basic realm=\"OtaHelper\"");
+  if (_configuration.web_ota.digest_auth) {
+    // Reuse the newest nonce while no client has used it, so that requests without credentials (e.g. a polling page)
+    // do not evict nonces still in use. Otherwise replace the oldest nonce.
+    auto now = esp_timer_get_time();
+    auto *nonce = &_digest_nonces[(_digest_next_nonce + MAX_DIGEST_NONCES - 1) % MAX_DIGEST_NONCES];
+    if (nonce->value[0] == 0 || nonce->last_nc != 0 ||
+        now - nonce->created_us > (int64_t)DIGEST_NONCE_LIFETIME_MS * 1000 / 2) {
+      nonce = &_digest_nonces[_digest_next_nonce];
+      _digest_next_nonce = (_digest_next_nonce + 1) % MAX_DIGEST_NONCES;
+      uint8_t random[16];
+      esp_fill_random(random, sizeof(random));
+      ConnectionHelperUtils::toHex(random, sizeof(random), nonce->value);
+      nonce->last_nc = 0;
+      nonce->created_us = now;
+    }
+    _www_authenticate = "Digest realm=\"" AUTH_REALM "\", qop=\"auth\", algorithm=MD5, nonce=\"" +
+                        std::string(nonce->value) + "\"" + (stale_nonce ? ", stale=true" : "");
+    httpd_resp_set_hdr(req, "WWW-Authenticate", _www_authenticate.c_str());
+  } else {
+    httpd_resp_set_hdr(req, "WWW-Authenticate", "Basic realm=\"" AUTH_REALM "\"");
+  }
   httpd_resp_send(req, "Not authenticated", HTTPD_RESP_USE_STRLEN);
 }
 
-bool OtaHelper::handleAuthentication(httpd_req_t *req) {
-  if (_configuration.web_ota.credentials.username.empty()) {
-    return true; // early return, nothing to authenticate.
+/**
+ * @brief Encode credentials once, so that requests are authenticated without encoding or allocating.
+ */
+void OtaHelper::prepareAuthentication() {
+  auto &credentials = _configuration.web_ota.credentials;
+  _basic_authorization.clear();
+  _digest_ha1[0] = 0;
+  if (credentials.username.empty()) {
+    return;
   }
 
-  size_t authorization_len = httpd_req_get_hdr_value_len(req, AUTHORIZATION_HDR_KEY) + 1;
-  if (authorization_len > 1) {
-    char *authorization = (char *)malloc(authorization_len);
-    esp_err_t err = httpd_req_get_hdr_value_str(req, AUTHORIZATION_HDR_KEY, authorization, authorization_len);
-    if (err != ESP_OK) {
-      log(ESP_LOG_ERROR, "Unable to get authorization header: " + std::string(esp_err_to_name(err)));
-      setNotAuthenticatedResonse(req);
-      return false;
+  std::string user_info = credentials.username + ":" + credentials.password;
+  size_t encoded_length = 0;
+  esp_crypto_base64_encode(NULL, 0, &encoded_length, (const unsigned char *)user_info.c_str(), user_info.length());
+  std::string encoded(encoded_length, '\0');
+  esp_crypto_base64_encode((unsigned char *)encoded.data(), encoded_length, &encoded_length,
+                           (const unsigned char *)user_info.c_str(), user_info.length());
+  encoded.resize(encoded_length);
+  _basic_authorization = "Basic " + encoded;
+
+  ConnectionHelperUtils::MD5Builder ha1;
+  ha1.begin();
+  ha1.add(credentials.username + ":" AUTH_REALM ":" + credentials.password);
+  ha1.calculate();
+  ha1.getChars(_digest_ha1);
+}
+
+/**
+ * @brief Return the value of a parameter of a Digest Authorization header, unquoted. Empty if not found.
+ */
+static std::string_view digestParameter(std::string_view parameters, std::string_view name) {
+  size_t position = 0;
+  while (position < parameters.size()) {
+    while (position < parameters.size() && (parameters[position] == ' ' || parameters[position] == ',')) {
+      position++;
+    }
+    size_t equals = parameters.find('=', position);
+    if (equals == std::string_view::npos) {
+      break;
+    }
+    auto key = parameters.substr(position, equals - position);
+    std::string_view value;
+    if (equals + 1 < parameters.size() && parameters[equals + 1] == '"') {
+      size_t end = parameters.find('"', equals + 2);
+      if (end == std::string_view::npos) {
+        break;
+      }
+      value = parameters.substr(equals + 2, end - equals - 2);
+      position = end + 1;
+    } else {
+      size_t end = std::min(parameters.find(',', equals + 1), parameters.size());
+      value = parameters.substr(equals + 1, end - equals - 1);
+      position = end;
+    }
+    if (key.size() == name.size() && strncasecmp(key.data(), name.data(), name.size()) == 0) {
+      return value;
     }
+  }
+  return {};
+}
 
-    std::string user_info =
-        _configuration.web_ota.credentials.username + ":" + _configuration.web_ota.credentials.password;
-    size_t crypto_buffer_size = 0;
-    esp_crypto_base64_encode(NULL, 0, &crypto_buffer_size, (const unsigned char *)user_info.c_str(),
-                             user_info.length());
-    char buff[crypto_buffer_size];
-    esp_crypto_base64_encode((unsigned char *)buff, crypto_buffer_size, &crypto_buffer_size,
-                             (const unsigned char *)user_info.c_str(), user_info.length());
-    std::string expected_authorization = "Basic " + std::string(buff);
+bool OtaHelper::checkBasicAuthorization(std::string_view authorization) {
+  return authorization.size() == _basic_authorization.size() &&
+         ConnectionHelperUtils::constantTimeEquals((const uint8_t *)authorization.data(),
+                                                   (const uint8_t *)_basic_authorization.data(),
+                                                   _basic_authorization.size());
+}
 
-    if (expected_authorization != std::string(authorization)) {
-      log(ESP_LOG_WARN, "Credentials does not match");
-      setNotAuthenticatedResonse(req);
-      return false;
+bool OtaHelper::checkDigestAuthorization(httpd_req_t *req, std::string_view authorization, bool &stale_nonce) {
+  constexpr std::string_view scheme = "Digest ";
+  if (authorization.size() <= scheme.size() || strncasecmp(authorization.data(), scheme.data(), scheme.size()) != 0) {
+    return false;
+  }
+  auto parameters = authorization.substr(scheme.size());
+  auto nonce = digestParameter(parameters, "nonce");
+  auto uri = digestParameter(parameters, "uri");
+  auto qop = digestParameter(parameters, "qop");
+  auto nc = digestParameter(parameters, "nc");
+  auto cnonce = digestParameter(parameters, "cnonce");
+  auto response = digestParameter(parameters, "response");
+  if (digestParameter(parameters, "username") != _configuration.web_ota.credentials.username || qop != "auth" ||
+      nonce.empty() || nc.empty() || cnonce.empty() || response.size() != 32 || uri != std::string_view(req->uri)) {
+    return false;
+  }
+
+  char ha2[33];
+  ConnectionHelperUtils::MD5Builder md5;
+  md5.begin();
+  md5.add(req->method == HTTP_POST ? "POST:" : "GET:");
+  md5.add(uri);
+  md5.calculate();
+  md5.getChars(ha2);
+
+  md5.begin();
+  for (std::string_view part : {std::string_view(_digest_ha1), nonce, nc, cnonce, qop}) {
+    md5.add(part);
+    md5.add(":");
+  }
+  md5.add(std::string_view(ha2));
+  md5.calculate();
+  if (!md5.equals(response)) {
+    return false;
+  }
+
+  // Correct credentials, but the nonce must be one we issued, not expired.
+  auto now = esp_timer_get_time();
+  DigestNonce *issued = nullptr;
+  for (auto &candidate : _digest_nonces) {
+    if (candidate.value[0] != 0 && nonce == std::string_view(candidate.value) &&
+        now - candidate.created_us <= (int64_t)DIGEST_NONCE_LIFETIME_MS * 1000) {
+      issued = &candidate;
     }
+  }
+  if (issued == nullptr) {
+    stale_nonce = true;
+    return false;
+  }
+  // And the nonce count must increase, otherwise this is a replay of an earlier request, or another client got the same
+  // nonce before it was used. Stale, so that a legitimate client retries with a new nonce.
+  char nc_string[9] = {};
+  memcpy(nc_string, nc.data(), std::min(nc.size(), sizeof(nc_string) - 1));
+  char *end = nullptr;
+  uint32_t nc_value = strtoul(nc_string, &end, 16);
+  if (nc.size() != 8 || *end != 0 || nc_value <= issued->last_nc) {
+    log(ESP_LOG_WARN, "Rejecting reused Digest nonce count");
+    stale_nonce = true;
+    return false;
+  }
+  issued->last_nc = nc_value;
+  return true;
+}
 
-  } else {
+/**
+ * @brief Get the IP address of the client of the request as raw bytes, IPv4 zero padded. False if unknown.
+ */
+static bool clientAddress(httpd_req_t *req, uint8_t (&address)[16]) {
+  struct sockaddr_storage peer = {};
+  socklen_t length = sizeof(peer);
+  if (getpeername(httpd_req_to_sockfd(req), (struct sockaddr *)&peer, &length) != 0) {
+    return false;
+  }
+  memset(address, 0, sizeof(address));
+  if (peer.ss_family == AF_INET) {
+    memcpy(address, &((struct sockaddr_in *)&peer)->sin_addr, 4);
+    return true;
+  }
+#if LWIP_IPV6
+  if (peer.ss_family == AF_INET6) {
+    memcpy(address, &((struct sockaddr_in6 *)&peer)->sin6_addr, 16);
+    return true;
+  }
+#endif
+  return false;
+}
+
+bool OtaHelper::hasValidSessionCookie(httpd_req_t *req) {
+  if (_configuration.web_ota.session_timeout_ms == 0 || _session_token[0] == 0 ||
+      esp_timer_get_time() > _session_expires_us) {
+    return false;
+  }
+  uint8_t client[16];
+  if (!clientAddress(req, client) || memcmp(client, _session_client, sizeof(client)) != 0) {
+    return false;
+  }
+  char token[sizeof(_session_token)];
+  size_t token_length = sizeof(token);
+  if (httpd_req_get_cookie_val(req, SESSION_COOKIE_NAME, token, &token_length) != ESP_OK ||
+      strnlen(token, sizeof(token)) != sizeof(token) - 1) {
+    return false;
+  }
+  return ConnectionHelperUtils::constantTimeEquals((const uint8_t *)token, (const uint8_t *)_session_token,
+                                                   sizeof(token) - 1);
+}
+
+/**
+ * @brief Set a session cookie on the response, starting a new session if there is none.
+ */
+void OtaHelper::issueSessionCookie(httpd_req_t *req) {
+  auto timeout_ms = _configuration.web_ota.session_timeout_ms;
+  if (timeout_ms == 0) {
+    return;
+  }
+  uint8_t client[16];
+  if (!clientAddress(req, client)) {
+    return;
+  }
+  auto now = esp_timer_get_time();
+  if (_session_token[0] == 0 || now > _session_expires_us || memcmp(client, _session_client, sizeof(client)) != 0) {
+    // New session, ending the session of any other client.
+    uint8_t random[16];
+    esp_fill_random(random, sizeof(random));
+    ConnectionHelperUtils::toHex(random, sizeof(random), _session_token);
+    memcpy(_session_client, client, sizeof(client));
+    _session_expires_us = now + (int64_t)timeout_ms * 1000;
+  }
+  _session_cookie = SESSION_COOKIE_NAME "=" + std::string(_session_token) +
+                    "; Path=/; HttpOnly; SameSite=Strict; Max-Age=" +
+                    std::to_string((_session_expires_us - now) / 1000000);
+  httpd_resp_set_hdr(req, "Set-Cookie", _session_cookie.c_str());
+}
+
+bool OtaHelper::handleAuthentication(httpd_req_t *req) {
+  if (_configuration.web_ota.credentials.username.empty()) {
+    return true; // early return, nothing to authenticate.
+  }
+  if (hasValidSessionCookie(req)) {
+    return true;
+  }
+
+  size_t authorization_len = httpd_req_get_hdr_value_len(req, AUTHORIZATION_HDR_KEY);
+  if (authorization_len == 0) {
     log(ESP_LOG_INFO, "No credentials provided");
     setNotAuthenticatedResonse(req);
     return false;
   }
+  if (authorization_len >= AUTHORIZATION_MAX_LEN) {
+    log(ESP_LOG_WARN, "Authorization header too long");
+    setNotAuthenticatedResonse(req);
+    return false;
+  }
+
+  char authorization[AUTHORIZATION_MAX_LEN];
+  esp_err_t err = httpd_req_get_hdr_value_str(req, AUTHORIZATION_HDR_KEY, authorization, sizeof(authorization));
+  if (err != ESP_OK) {
+    log(ESP_LOG_ERROR, "Unable to get authorization header: " + std::string(esp_err_to_name(err)));
+    setNotAuthenticatedResonse(req);
+    return false;
+  }
+
+  bool stale_nonce = false;
+  std::string_view value(authorization, authorization_len);
+  bool authenticated = _configuration.web_ota.digest_auth ? checkDigestAuthorization(req, value, stale_nonce)
+                                                          : checkBasicAuthorization(value);
+  if (!authenticated) {
+    if (!stale_nonce) {
+      log(ESP_LOG_WARN, "Credentials does not match");
+    }
+    setNotAuthenticatedResonse(req, stale_nonce);
+    return false;
+  }
 
+  issueSessionCookie(req);
   return true; // All good.
 }
 
 esp_err_t OtaHelper::httpGetHandler(httpd_req_t *req) {
   OtaHelper *_this = (OtaHelper *)req->user_ctx;
+  _this->onActivity();
 
   if (!_this->handleAuthentication(req)) {
     return ESP_FAIL;
@@ -218,6 +715,7 @@ esp_err_t OtaHelper::httpGetHandler(httpd_req_t *req) {
 }
 esp_err_t OtaHelper::httpPostHandler(httpd_req_t *req) {
   OtaHelper *_this = (OtaHelper *)req->user_ctx;
+  _this->onActivity();
 
   if (!_this->handleAuthentication(req)) {
     return ESP_FAIL;
@@ -253,27 +751,65 @@ esp_err_t OtaHelper::httpPostHandler(httpd_req_t *req) {
     return ESP_FAIL;
   }
 
+  if (!_this->beginSession(UpdateSource::WEB_OTA, 0)) {
+    httpd_resp_set_status(req, HTTPD_503);
+    httpd_resp_send(req, "Update already in progress", HTTPD_RESP_USE_STRLEN);
+    return ESP_FAIL;
+  }
+
   _this->reportStatus(OtaStatus::UPDATE_STARTED);
   _this->log(ESP_LOG_INFO, "OTA started via HTTP with target partition: " + std::string(partition->label));
 
+  // Without content length, the body must be chunked (e.g. curl reading from a pipe).
+  bool chunked = false;
   if (req->content_len == 0) {
-    _this->log(ESP_LOG_ERROR, "No content received");
-    httpd_resp_send(req, "No content received", HTTPD_RESP_USE_STRLEN);
-    _this->reportStatus(OtaStatus::UPDATE_FAILED);
-    return ESP_FAIL;
+    char transfer_encoding[32] = {0};
+    chunked = httpd_req_get_hdr_value_str(req, TRANSFER_ENCODING_HDR_KEY, transfer_encoding,
+                                          sizeof(transfer_encoding)) == ESP_OK &&
+              strstr(transfer_encoding, "chunked") != nullptr;
+    if (!chunked) {
+      _this->log(ESP_LOG_ERROR, "No content received");
+      httpd_resp_send(req, "No content received", HTTPD_RESP_USE_STRLEN);
+      _this->reportStatus(OtaStatus::UPDATE_FAILED);
+      _this->endSession(false);
+      return ESP_FAIL;
+    }
+    // The chunked body is read from the socket, which misses anything httpd already read past the headers. So the
+    // client must wait for 100 Continue before sending the body (curl does so for chunked uploads).
+    char expect[32] = {0};
+    if (httpd_req_get_hdr_value_str(req, EXPECT_HDR_KEY, expect, sizeof(expect)) != ESP_OK ||
+        strcasecmp(expect, "100-continue") != 0) {
+      _this->log(ESP_LOG_ERROR, "Chunked body without " EXPECT_HDR_KEY ": 100-continue");
+      httpd_resp_set_status(req, HTTPD_417);
+      httpd_resp_send(req, "Chunked body requires " EXPECT_HDR_KEY ": 100-continue", HTTPD_RESP_USE_STRLEN);
+      _this->reportStatus(OtaStatus::UPDATE_FAILED);
+      _this->endSession(false);
+      httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
+      return ESP_FAIL;
+    }
+    httpd_socket_send(req->handle, httpd_req_to_sockfd(req), HTTP_100_CONTINUE, strlen(HTTP_100_CONTINUE), 0);
+    _this->log(ESP_LOG_INFO, "Receiving chunked body of unknown length");
   }
 
   std::string md5hash = ""; // No hash
-  if (!_this->writeStreamToPartition(partition, flash_mode, req->content_len, md5hash,
-                                     [&_this, req](char *buffer, size_t buffer_size, size_t total_bytes_left) {
-                                       return _this->fillBuffer(req, buffer, buffer_size);
-                                     })) {
+  ConnectionHelperUtils::ChunkedDecoder decoder;
+  size_t content_length = chunked ? OtaSink::UNKNOWN_SIZE : req->content_len;
+  if (!_this->writeStreamToPartition(
+          partition, flash_mode, content_length, md5hash,
+          [&_this, &decoder, req, chunked](char *buffer, size_t buffer_size, size_t total_bytes_left) {
+            return chunked ? _this->fillBufferChunked(req, decoder, buffer, buffer_size)
+                           : _this->fillBuffer(req, buffer, buffer_size);
+          })) {
     _this->log(ESP_LOG_ERROR, "Failed to write stream to partition");
     httpd_resp_send(req, "Failed to write stream to partition", HTTPD_RESP_USE_STRLEN);
     _this->reportStatus(OtaStatus::UPDATE_FAILED);
+    _this->endSession(false);
+    // The rest of the body is not read, so it must not be parsed as the next request.
+    httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
     return ESP_FAIL;
   }
 
+  _this->endSession(true);
   _this->reportStatus(OtaStatus::UPDATE_COMPLETED);
   _this->log(ESP_LOG_INFO, "HTTP OTA complete, rebooting...");
 
@@ -284,6 +820,123 @@ esp_err_t OtaHelper::httpPostHandler(httpd_req_t *req) {
   return ESP_OK;
 }
 
+/**
+ * @brief Serve the running firmware to other devices, see WebOta::serve_firmware.
+ */
+esp_err_t OtaHelper::httpFirmwareGetHandler(httpd_req_t *req) {
+  OtaHelper *_this = (OtaHelper *)req->user_ctx;
+  _this->onActivity();
+
+  if (!_this->handleAuthentication(req)) {
+    return ESP_FAIL;
+  }
+
+  if (!_this->loadServedImage()) {
+    httpd_resp_set_status(req, HTTPD_500);
+    httpd_resp_send(req, "Unable to read running firmware", HTTPD_RESP_USE_STRLEN);
+    return ESP_FAIL;
+  }
+
+  auto &image = *_this->_served_image;
+  auto length = std::to_string(image.length);
+  httpd_resp_set_status(req, HTTPD_200);
+  httpd_resp_set_type(req, "application/octet-stream");
+  httpd_resp_set_hdr(req, "X-Image-Length", length.c_str());
+  httpd_resp_set_hdr(req, IMAGE_MD5_HDR_KEY, image.md5.c_str());
+  httpd_resp_set_hdr(req, "X-Image-SHA256", image.sha256.c_str());
+  httpd_resp_set_hdr(req, "X-App-Project", image.project_name.c_str());
+  httpd_resp_set_hdr(req, "X-App-Version", image.version.c_str());
+  httpd_resp_set_hdr(req, "X-App-IDF-Version", image.idf_version.c_str());
+  httpd_resp_set_hdr(req, "X-App-Secure-Version", image.secure_version.c_str());
+
+  _this->log(ESP_LOG_INFO, "Serving running firmware, " + length + " bytes");
+  auto max_bytes_per_second = _this->_configuration.web_ota.serve_max_bytes_per_second;
+  auto started_us = esp_timer_get_time();
+  size_t sent = 0;
+  // Send straight from memory mapped flash, in slices to be able to rate limit.
+  bool success = _this->forEachMappedWindow(
+      _this->_served_partition, image.length, [&](const uint8_t *data, size_t length) {
+        for (size_t offset = 0; offset < length; offset += SERVE_SLICE_SIZE) {
+          size_t slice = std::min(length - offset, (size_t)SERVE_SLICE_SIZE);
+          if (httpd_resp_send_chunk(req, (const char *)data + offset, slice) != ESP_OK) {
+            _this->log(ESP_LOG_WARN, "Failed to send firmware, client gone?");
+            return false;
+          }
+          sent += slice;
+          if (max_bytes_per_second > 0) {
+            int64_t ahead_us = (int64_t)sent * 1000000 / max_bytes_per_second - (esp_timer_get_time() - started_us);
+            if (ahead_us >= 1000 * portTICK_PERIOD_MS) {
+              vTaskDelay(ahead_us / 1000 / portTICK_PERIOD_MS);
+            }
+          }
+          _this->onActivity();
+        }
+        return true;
+      });
+  if (!success) {
+    return ESP_FAIL;
+  }
+  httpd_resp_send_chunk(req, NULL, 0);
+  _this->log(ESP_LOG_INFO, "Served running firmware in " + std::to_string((esp_timer_get_time() - started_us) / 1000) +
+                               "ms");
+  return ESP_OK;
+}
+
+/**
+ * @brief Read length, hashes and description of the running firmware, once.
+ */
+bool OtaHelper::loadServedImage() {
+  if (_served_image) {
+    return true;
+  }
+
+  _served_partition = esp_ota_get_running_partition();
+  const esp_partition_pos_t position = {
+      .offset = _served_partition->address,
+      .size = _served_partition->size,
+  };
+  esp_image_metadata_t metadata;
+  if (!reportOnError(esp_image_verify(ESP_IMAGE_VERIFY_SILENT, &position, &metadata),
+                     "Failed to get length of running firmware")) {
+    return false;
+  }
+
+  ServedImage image;
+  image.length = metadata.image_len;
+
+  uint8_t sha256[32];
+  if (!reportOnError(esp_partition_get_sha256(_served_partition, sha256),
+                     "Failed to get SHA-256 of running firmware")) {
+    return false;
+  }
+  char sha256_hex[sizeof(sha256) * 2 + 1];
+  ConnectionHelperUtils::toHex(sha256, sizeof(sha256), sha256_hex);
+  image.sha256 = sha256_hex;
+
+  ConnectionHelperUtils::MD5Builder md5;
+  md5.begin();
+  if (!forEachMappedWindow(_served_partition, image.length, [&md5](const uint8_t *data, size_t length) {
+        md5.add(data, length);
+        return true;
+      })) {
+    return false;
+  }
+  md5.calculate();
+  image.md5 = md5.toString();
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  const esp_app_desc_t *app = esp_app_get_description();
+#else
+  const esp_app_desc_t *app = esp_ota_get_app_description();
+#endif
+  image.project_name = std::string(app->project_name, strnlen(app->project_name, sizeof(app->project_name)));
+  image.version = std::string(app->version, strnlen(app->version, sizeof(app->version)));
+  image.idf_version = std::string(app->idf_ver, strnlen(app->idf_ver, sizeof(app->idf_ver)));
+  image.secure_version = std::to_string(app->secure_version);
+  _served_image = image;
+  return true;
+}
+
 bool OtaHelper::startWebserver() {
   httpd_handle_t server = NULL;
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
@@ -291,12 +944,18 @@ bool OtaHelper::startWebserver() {
   config.ctrl_port = config.ctrl_port + _configuration.web_ota.http_port;
   config.server_port = _configuration.web_ota.http_port;
   config.lru_purge_enable = true;
-  config.max_uri_handlers = _configuration.web_ota.ui_enabled ? 2 : 1;
+  config.max_uri_handlers =
+      1 + (_configuration.web_ota.ui_enabled ? 1 : 0) + (_configuration.web_ota.serve_firmware ? 1 : 0);
   config.max_open_sockets = 2;
+  config.task_priority = _configuration.web_ota.task_priority;
+  config.stack_size = _configuration.web_ota.task_stack_size;
+  config.core_id = _configuration.web_ota.task_core_id;
+  config.recv_wait_timeout = _configuration.transfer.web_recv_timeout_s;
 
   if (!reportOnError(httpd_start(&server, &config), "failed to start httpd")) {
     return false;
   }
+  _httpd_handle = server;
 
   const httpd_uri_t ota_post = {
       .uri = "/",
@@ -320,7 +979,23 @@ bool OtaHelper::startWebserver() {
     }
   }
 
-  xEventGroupSetBits(_rollback_event_group, WEB_OTA_STARTED_BIT);
+  if (_configuration.web_ota.serve_firmware) {
+    httpd_uri_t firmware_get = {
+        .uri = FIRMWARE_URI,
+        .method = HTTP_GET,
+        .handler = httpFirmwareGetHandler,
+        .user_ctx = this,
+    };
+    if (!reportOnError(httpd_register_uri_handler(server, &firmware_get),
+                       "failed to register uri handler for serving firmware")) {
+      return false;
+    }
+  }
+
+  if (setStartupTiming(&StartupTimings::httpd_started_us, esp_timer_get_time())) {
+    onStartupPhaseCompleted();
+  }
+  onServiceStarted(WEB_OTA_STARTED_BIT);
   return true;
 }
 
@@ -344,6 +1019,30 @@ int OtaHelper::fillBuffer(httpd_req_t *req, char *buffer, size_t buffer_size) {
   return total_read;
 }
 
+/**
+ * @brief Fill buffer with data from a chunked body from HTTP local webserver. Returns 0 at end of body.
+ * httpd does not decode chunked request bodies (httpd_req_recv() is bounded by content length), so the raw body is
+ * read from the socket. Only valid after sending 100 Continue, see httpPostHandler().
+ */
+int OtaHelper::fillBufferChunked(httpd_req_t *req, ConnectionHelperUtils::ChunkedDecoder &decoder, char *buffer,
+                                 size_t buffer_size) {
+  int sockfd = httpd_req_to_sockfd(req);
+  size_t total_read = 0;
+  while (total_read < buffer_size && !decoder.done()) {
+    int read = httpd_socket_recv(req->handle, sockfd, buffer + total_read, buffer_size - total_read, 0);
+    if (read <= 0) {
+      log(ESP_LOG_ERROR, "Failed to fill buffer, connection closed or timed out before end of chunked body.");
+      return -1;
+    }
+    total_read += decoder.decode(buffer + total_read, read);
+    if (decoder.failed()) {
+      log(ESP_LOG_ERROR, "Failed to fill buffer, invalid chunked encoding.");
+      return -1;
+    }
+  }
+  return total_read;
+}
+
 // #########################################################################
 // OTA via remote URI
 // #########################################################################
@@ -369,6 +1068,9 @@ esp_err_t OtaHelper::httpEventHandler(esp_http_client_event_t *evt) {
   case HTTP_EVENT_ON_HEADER:
     _this->log(ESP_LOG_VERBOSE, "HTTP_EVENT_ON_HEADER, key=" + std::string(evt->header_key) +
                                     ", value=" + std::string(evt->header_value));
+    if (strcasecmp(evt->header_key, IMAGE_MD5_HDR_KEY) == 0) {
+      _this->_remote_md5_header = evt->header_value;
+    }
     break;
   case HTTP_EVENT_ON_DATA:
     _this->log(ESP_LOG_VERBOSE, "HTTP_EVENT_ON_DATA, len=" + std::to_string(evt->data_len));
@@ -386,62 +1088,167 @@ esp_err_t OtaHelper::httpEventHandler(esp_http_client_event_t *evt) {
 
 bool OtaHelper::downloadAndWriteToPartition(const esp_partition_t *partition, FlashMode flash_mode, std::string &url,
                                             std::string &md5hash) {
-
-  esp_http_client_config_t config = {};
-  config.url = url.c_str();
-  config.user_data = this;
-  config.event_handler = httpEventHandler;
-  config.buffer_size = SPI_FLASH_SEC_SIZE;
-  if (_crt_bundle_attach) {
-    config.crt_bundle_attach = _crt_bundle_attach;
-    log(ESP_LOG_INFO, "With TLS/HTTPS support");
-  } else {
-    log(ESP_LOG_INFO, "Without TLS/HTTPS support");
+  bool reused = false;
+  esp_http_client_handle_t client = acquireRemoteClient(url, reused);
+  if (client == nullptr) {
+    log(ESP_LOG_ERROR, "Failed to create HTTP client");
+    return false;
   }
-  esp_http_client_handle_t client = esp_http_client_init(&config);
+  _remote_md5_header.clear();
 
   log(ESP_LOG_INFO, "Using URL " + url);
   esp_http_client_set_method(client, HTTP_METHOD_GET);
   esp_http_client_set_header(client, "Accept", "*/*");
-  esp_http_client_set_timeout_ms(client, HTTP_REMOTE_TIMEOUT_MS);
+  esp_http_client_set_timeout_ms(client, _configuration.transfer.http_timeout_ms);
 
   bool success = false;
-  esp_err_t r = esp_http_client_open(client, 0);
-  if (r == ESP_OK) {
-    esp_http_client_fetch_headers(client);
+  bool keep = false;
+  uint8_t redirects = 0;
+  while (1) {
+    esp_err_t r = esp_http_client_open(client, 0);
+    int64_t header_result = r == ESP_OK ? esp_http_client_fetch_headers(client) : -1;
+    if (reused && (header_result < 0 || (header_result == 0 && esp_http_client_get_status_code(client) <= 0))) {
+      // The server might have closed the kept connection while idle. Writing the request usually still succeeds, so
+      // this shows when reading the response. Reconnect once.
+      log(ESP_LOG_INFO, "Kept connection closed, reconnecting");
+      esp_http_client_close(client);
+      r = esp_http_client_open(client, 0);
+      header_result = r == ESP_OK ? esp_http_client_fetch_headers(client) : -1;
+    }
+    reused = false;
+    if (r != ESP_OK) {
+      const char *errstr = esp_err_to_name(r);
+      log(ESP_LOG_ERROR, "Failed to open HTTP connection: " + std::string(errstr));
+      break;
+    }
+    if (header_result < 0) {
+      log(ESP_LOG_ERROR, "Failed to read HTTP response headers");
+      break;
+    }
+
     auto status_code = esp_http_client_get_status_code(client);
     auto content_length = esp_http_client_get_content_length(client);
     log(ESP_LOG_INFO,
         "HTTP status code: " + std::to_string(status_code) + ", content length: " + std::to_string(content_length));
 
-    if (status_code == 200) {
-      uint32_t partition_size = partition->size;
-      if (content_length > partition_size) {
-        log(ESP_LOG_ERROR, "Content length " + std::to_string(content_length) + " is larger than partition size " +
-                               std::to_string(partition_size));
+    bool redirect = status_code == 301 || status_code == 302 || status_code == 303 || status_code == 307 ||
+                    status_code == 308;
+    if (redirect && redirects < _configuration.remote_http.max_redirects) {
+      redirects++;
+      // Drain the body so that the connection can be used for the next request, if to the same origin.
+      esp_http_client_flush_response(client, NULL);
+      if (!reportOnError(esp_http_client_set_redirection(client), "Failed to follow redirect")) {
+        break;
+      }
+      // The connection is kept for the origin redirected to.
+      char redirected_url[REDIRECT_URL_MAX_LEN];
+      _remote_client_origin = esp_http_client_get_url(client, redirected_url, sizeof(redirected_url)) == ESP_OK
+                                  ? originOf(redirected_url)
+                                  : "";
+      log(ESP_LOG_INFO, "Following redirect");
+      continue;
+    }
 
-      } else {
-        success = writeStreamToPartition(partition, flash_mode, content_length, md5hash,
-                                         [&](char *buffer, size_t buffer_size, size_t total_bytes_left) {
-                                           return fillBuffer(client, buffer, buffer_size);
-                                         });
+    if (status_code == 200) {
+      // Chunked or close delimited responses have no content length.
+      size_t length = content_length < 0 ? OtaSink::UNKNOWN_SIZE : content_length;
+      // Served by another device (see WebOta::serve_firmware), which provides the MD5.
+      std::string md5 = md5hash;
+      if (md5.empty() && _remote_md5_header.length() == 32) {
+        log(ESP_LOG_INFO, "Using MD5 from " IMAGE_MD5_HDR_KEY " header: " + _remote_md5_header);
+        md5 = _remote_md5_header;
       }
+      success = writeStreamToPartition(partition, flash_mode, length, md5,
+                                       [&](char *buffer, size_t buffer_size, size_t total_bytes_left) {
+                                         return fillBuffer(client, buffer, buffer_size);
+                                       });
+      // Close delimited responses can not be followed by another request.
+      keep = success && !_remote_client_origin.empty() && esp_http_client_is_complete_data_received(client) &&
+             (content_length >= 0 || esp_http_client_is_chunked_response(client));
     } else {
       log(ESP_LOG_ERROR, "Got non 200 status code: " + std::to_string(status_code));
+      keep = !_remote_client_origin.empty() && esp_http_client_flush_response(client, NULL) == ESP_OK;
     }
-
-  } else {
-    const char *errstr = esp_err_to_name(r);
-    log(ESP_LOG_ERROR, "Failed to open HTTP connection: " + std::string(errstr));
+    break;
   }
 
-  esp_http_client_close(client);
-  esp_http_client_cleanup(client);
-
+  releaseRemoteClient(client, keep);
   return success;
 }
 
-/**
+void OtaHelper::closeRemoteConnection() {
+  xSemaphoreTake(_session_semaphore, portMAX_DELAY);
+  releaseRemoteClient(nullptr, false);
+  xSemaphoreGive(_session_semaphore);
+}
+
+/**
+ * @brief Return the kept client if for the same origin as url, otherwise a new client. Must hold the session.
+ */
+esp_http_client_handle_t OtaHelper::acquireRemoteClient(std::string &url, bool &reused) {
+  auto origin = originOf(url);
+  if (_remote_client != nullptr) {
+    auto client = _remote_client;
+    _remote_client = nullptr;
+    if (origin == _remote_client_origin && esp_http_client_set_url(client, url.c_str()) == ESP_OK) {
+      log(ESP_LOG_INFO, "Reusing connection to " + origin);
+      reused = true;
+      return client;
+    }
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+  }
+
+  esp_http_client_config_t config = {};
+  config.url = url.c_str();
+  config.user_data = this;
+  config.event_handler = httpEventHandler;
+  config.buffer_size = _configuration.transfer.http_rx_buffer_size;
+  config.buffer_size_tx = _configuration.transfer.http_tx_buffer_size;
+  if (_crt_bundle_attach) {
+    config.crt_bundle_attach = _crt_bundle_attach;
+    log(ESP_LOG_INFO, "With TLS/HTTPS support");
+  } else {
+    log(ESP_LOG_INFO, "Without TLS/HTTPS support");
+  }
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0) && defined(CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS)
+  config.save_client_session =
+      _configuration.remote_http.reuse_connection && _configuration.remote_http.resume_tls_session;
+#endif
+  _remote_client_origin = origin;
+  reused = false;
+  return esp_http_client_init(&config);
+}
+
+/**
+ * @brief Keep the client for the next call if keep and reuse is enabled, otherwise close it. If client is nullptr,
+ * close the kept client, if any. Must hold the session.
+ */
+void OtaHelper::releaseRemoteClient(esp_http_client_handle_t client, bool keep) {
+  if (client != nullptr && keep && _configuration.remote_http.reuse_connection) {
+    _remote_client = client;
+    return;
+  }
+  if (client == nullptr) {
+    client = _remote_client;
+    _remote_client = nullptr;
+  }
+  if (client != nullptr) {
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+  }
+}
+
+/**
+ * @brief Return scheme, user info, host and port of url, i.e. everything up to the path.
+ */
+std::string OtaHelper::originOf(const std::string &url) {
+  auto scheme_end = url.find("://");
+  auto path_start = url.find('/', scheme_end == std::string::npos ? 0 : scheme_end + 3);
+  return url.substr(0, path_start);
+}
+
+/**
  * @brief Fill buffer with data from URI/remote HTTP server.
  */
 int OtaHelper::fillBuffer(esp_http_client_handle_t client, char *buffer, size_t buffer_size) {
@@ -449,7 +1256,9 @@ int OtaHelper::fillBuffer(esp_http_client_handle_t client, char *buffer, size_t
   while (total_read < buffer_size) {
     int read = esp_http_client_read(client, buffer + total_read, buffer_size - total_read);
     if (read <= 0) {
-      if (esp_http_client_is_complete_data_received(client)) {
+      bool close_delimited = read == 0 && esp_http_client_get_content_length(client) < 0 &&
+                             !esp_http_client_is_chunked_response(client);
+      if (esp_http_client_is_complete_data_received(client) || close_delimited) {
         return total_read;
       } else {
         log(ESP_LOG_ERROR, "Failed to fill buffer, read zero and not complete.");
@@ -468,143 +1277,188 @@ int OtaHelper::fillBuffer(esp_http_client_handle_t client, char *buffer, size_t
 void OtaHelper::arduinoOtaUdpServerTask(void *pvParameters) {
   OtaHelper *_this = (OtaHelper *)pvParameters;
 
-  char rx_buffer[512];
-  char addr_str[128];
-  auto port = _this->_configuration.arduino_ota.udp_listenting_port;
-
-  while (1) {
-    // Two state management: if false we are waiting for the first normal handshake package. But if set to true we are
-    // waiting for the second authentication package.
-    // This is reset on any failure.
-    bool waiting_for_auth = false;
-    std::string auth_nonce = "";
-    std::optional<ArduinoOtaHandshake> handshake_packet;
-
-    struct sockaddr_in dest_addr_ip4;
-    dest_addr_ip4.sin_addr.s_addr = htonl(INADDR_ANY);
-    dest_addr_ip4.sin_family = AF_INET;
-    dest_addr_ip4.sin_port = htons(port);
-    int ip_protocol = IPPROTO_IP;
-
-    int sock = socket(AF_INET, SOCK_DGRAM, ip_protocol);
+  while (!_this->_arduino_ota_stop) {
+    // With on demand activation, wake up regularly to check if deactivated.
+    int sock = _this->openArduinoOtaSocket(_this->_configuration.on_demand.enabled ? ARDUINO_OTA_RECV_TIMEOUT_MS : 0);
     if (sock < 0) {
-      _this->log(ESP_LOG_ERROR, "Unable to create UDP socket: errno " + std::to_string(errno));
+      _this->notifyReady(false);
       break;
     }
-    _this->log(ESP_LOG_INFO, "UDP socket created");
-
-    int err = bind(sock, (struct sockaddr *)&dest_addr_ip4, sizeof(dest_addr_ip4));
-    if (err < 0) {
-      _this->log(ESP_LOG_ERROR, "UDP socket unable to bind: errno " + std::to_string(errno));
-      break;
+    ArduinoOtaState state;
+    while (!_this->_arduino_ota_stop && _this->handleArduinoOtaPacket(sock, state)) {
     }
-    _this->log(ESP_LOG_INFO, "UDP socket bound, port " + std::to_string(port));
-    xEventGroupSetBits(_this->_rollback_event_group, ARDUINO_OTA_STARTED_BIT);
-
-    struct sockaddr_storage source_addr;
-    socklen_t socklen = sizeof(source_addr);
+    _this->closeArduinoOtaSocket(sock);
+  }
+  _this->_arduino_ota_running = false;
+  vTaskDelete(NULL);
+}
 
-    while (1) {
-      _this->log(ESP_LOG_INFO, "waiting UDP packet...");
-      int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr *)&source_addr, &socklen);
-      _this->log(ESP_LOG_VERBOSE, "Got UDP packet with length " + std::to_string(len));
+/**
+ * @brief Create and bind the ArduinoOTA UDP socket.
+ *
+ * @param recv_timeout_ms receive timeout, 0 to block.
+ * @return the socket, or -1 on failure.
+ */
+int OtaHelper::openArduinoOtaSocket(uint32_t recv_timeout_ms) {
+  auto port = _configuration.arduino_ota.udp_listenting_port;
+  struct sockaddr_in dest_addr_ip4;
+  dest_addr_ip4.sin_addr.s_addr = htonl(INADDR_ANY);
+  dest_addr_ip4.sin_family = AF_INET;
+  dest_addr_ip4.sin_port = htons(port);
+  int ip_protocol = IPPROTO_IP;
+
+  int sock = socket(AF_INET, SOCK_DGRAM, ip_protocol);
+  if (sock < 0) {
+    log(ESP_LOG_ERROR, "Unable to create UDP socket: errno " + std::to_string(errno));
+    return -1;
+  }
+  log(ESP_LOG_INFO, "UDP socket created");
 
-      // Error occurred during receiving?
-      if (len < 0) {
-        _this->log(ESP_LOG_ERROR, "UDP recvfrom failed: errno " + std::to_string(errno));
-        break;
-      } else {
-        std::string reply_string;
+  int err = bind(sock, (struct sockaddr *)&dest_addr_ip4, sizeof(dest_addr_ip4));
+  if (err < 0) {
+    log(ESP_LOG_ERROR, "UDP socket unable to bind: errno " + std::to_string(errno));
+    close(sock);
+    return -1;
+  }
+  log(ESP_LOG_INFO, "UDP socket bound, port " + std::to_string(port));
+  if (recv_timeout_ms > 0) {
+    struct timeval timeout = {.tv_sec = (time_t)(recv_timeout_ms / 1000),
+                              .tv_usec = (suseconds_t)(recv_timeout_ms % 1000 * 1000)};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+  if (setStartupTiming(&StartupTimings::udp_bound_us, esp_timer_get_time())) {
+    onStartupPhaseCompleted();
+  }
+  onServiceStarted(ARDUINO_OTA_STARTED_BIT);
+  return sock;
+}
 
-        // Parse packets conditionally.
-        std::optional<ArduinoAuthUpdate> auth_packet;
+void OtaHelper::closeArduinoOtaSocket(int sock) {
+  if (_arduino_ota_stop) {
+    log(ESP_LOG_INFO, "Shutting down UDP, ArduinoOTA deactivated");
+  } else {
+    log(ESP_LOG_ERROR, "Shutting down UDP and restarting socket...");
+  }
+  shutdown(sock, 0);
+  close(sock);
+}
 
-        if (!waiting_for_auth) {
-          handshake_packet = _this->parseHandshakeUdpPacket(rx_buffer, len);
-          if (!handshake_packet) {
-            _this->log(ESP_LOG_ERROR, "Failed to parse handshake UDP packet");
-            break;
-          }
+/**
+ * @brief Receive and handle one ArduinoOTA packet, running the update if the invitation is accepted.
+ *
+ * @return false if the socket should be recreated, i.e. on error or after an update.
+ */
+bool OtaHelper::handleArduinoOtaPacket(int sock, ArduinoOtaState &state) {
+  char rx_buffer[512];
+  char addr_str[128];
 
-          // Need auth?
-          if (!_this->_configuration.arduino_ota.password.empty()) {
-            // Generate nounce.
-            ConnectionHelperUtils::MD5Builder nonce_md5;
-            nonce_md5.begin();
-            nonce_md5.add(std::to_string(esp_timer_get_time()));
-            nonce_md5.calculate();
-            auth_nonce = nonce_md5.toString();
-            reply_string = "AUTH " + auth_nonce;
-            waiting_for_auth = true;
-          } else {
-            // Send OK
-            reply_string = "OK";
-          }
+  struct sockaddr_storage source_addr;
+  socklen_t socklen = sizeof(source_addr);
+  int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr *)&source_addr, &socklen);
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true; // Receive timeout.
+  }
+  // Error occurred during receiving?
+  if (len < 0) {
+    log(ESP_LOG_ERROR, "UDP recvfrom failed: errno " + std::to_string(errno));
+    return false;
+  }
+  rx_buffer[len] = 0;
+  if (isLogEnabled(ESP_LOG_VERBOSE)) {
+    log(ESP_LOG_VERBOSE, "Got UDP packet with length " + std::to_string(len));
+  }
+  onActivity();
 
-        } else {
-          auth_packet = _this->parseAuthUdpPacket(rx_buffer, len);
-          if (!auth_packet) {
-            _this->log(ESP_LOG_ERROR, "Failed to parse auth UDP packet");
-            break;
-          }
+  std::string reply_string;
 
-          // Verify authentication
-          ConnectionHelperUtils::MD5Builder passwordmd5;
-          passwordmd5.begin();
-          passwordmd5.add(_this->_configuration.arduino_ota.password);
-          passwordmd5.calculate();
-          auto challenge = passwordmd5.toString() + ":" + auth_nonce + ":" + auth_packet->cnonce;
-
-          ConnectionHelperUtils::MD5Builder challengemd5;
-          challengemd5.begin();
-          challengemd5.add(challenge);
-          challengemd5.calculate();
-          auto result = challengemd5.toString();
-          if (result == auth_packet->response) {
-            reply_string = "OK";
-          } else {
-            _this->log(ESP_LOG_WARN, "Authentication Failed");
-            reply_string = "Authentication Failed";
-          }
+  // Parse packets conditionally.
+  std::optional<ArduinoAuthUpdate> auth_packet;
 
-          waiting_for_auth = false;
-        }
+  if (!state.waiting_for_auth) {
+    state.handshake_packet = parseHandshakeUdpPacket(rx_buffer, len);
+    if (!state.handshake_packet) {
+      log(ESP_LOG_ERROR, "Failed to parse handshake UDP packet");
+      return false;
+    }
 
-        // Get the sender's ip address as string
-        inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
+    if (isUpdateInProgress()) {
+      // Reject right away, espota fails on any reply other than OK or AUTH.
+      log(ESP_LOG_WARN, "Rejecting ArduinoOTA invitation, update already in progress");
+      reply_string = ESPOTA_BUSY;
+      state.handshake_packet.reset();
+    } else if (!_configuration.arduino_ota.password.empty()) {
+      // Need auth, generate nounce.
+      ConnectionHelperUtils::MD5Builder nonce_md5;
+      nonce_md5.begin();
+      nonce_md5.add(std::to_string(esp_timer_get_time()));
+      nonce_md5.calculate();
+      state.auth_nonce = nonce_md5.toString();
+      reply_string = "AUTH " + state.auth_nonce;
+      state.waiting_for_auth = true;
+    } else {
+      // Send OK
+      reply_string = "OK";
+    }
 
-        int err = sendto(sock, reply_string.c_str(), reply_string.size(), 0, (struct sockaddr *)&source_addr,
-                         sizeof(source_addr));
-        if (err < 0) {
-          _this->log(ESP_LOG_ERROR, "error occurred during sending UDP: errno " + std::to_string(errno));
-          break;
-        } else {
-          _this->log(ESP_LOG_VERBOSE, "Sent UDP reply: " + reply_string);
-        }
+  } else {
+    auth_packet = parseAuthUdpPacket(rx_buffer, len);
+    if (!auth_packet) {
+      log(ESP_LOG_ERROR, "Failed to parse auth UDP packet");
+      return false;
+    }
 
-        // Handle OTA (if not waiting for auth)
-        if (handshake_packet && !waiting_for_auth) {
-          _this->reportStatus(OtaStatus::UPDATE_STARTED);
-          auto result = _this->connectToHostForArduino(*handshake_packet, addr_str);
-          if (result) {
-            _this->reportStatus(OtaStatus::UPDATE_COMPLETED);
-            vTaskDelay(2000 / portTICK_PERIOD_MS);
-            esp_restart();
-          } else {
-            _this->reportStatus(OtaStatus::UPDATE_FAILED);
-          }
-          break; // Fail or OK, restart UDP.
-        }
-      }
+    // Verify authentication
+    ConnectionHelperUtils::MD5Builder passwordmd5;
+    passwordmd5.begin();
+    passwordmd5.add(_configuration.arduino_ota.password);
+    passwordmd5.calculate();
+    auto challenge = passwordmd5.toString() + ":" + state.auth_nonce + ":" + auth_packet->cnonce;
+
+    ConnectionHelperUtils::MD5Builder challengemd5;
+    challengemd5.begin();
+    challengemd5.add(challenge);
+    challengemd5.calculate();
+    if (challengemd5.equals(auth_packet->response)) {
+      reply_string = "OK";
+    } else {
+      log(ESP_LOG_WARN, "Authentication Failed");
+      reply_string = "Authentication Failed";
+      state.handshake_packet.reset();
     }
 
-    if (sock != -1) {
-      _this->log(ESP_LOG_ERROR, "Shutting down UDP and restarting socket...");
-      shutdown(sock, 0);
-      close(sock);
+    state.waiting_for_auth = false;
+  }
+
+  // Get the sender's ip address as string
+  inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
+
+  int err =
+      sendto(sock, reply_string.c_str(), reply_string.size(), 0, (struct sockaddr *)&source_addr, sizeof(source_addr));
+  if (err < 0) {
+    log(ESP_LOG_ERROR, "error occurred during sending UDP: errno " + std::to_string(errno));
+    return false;
+  } else if (isLogEnabled(ESP_LOG_VERBOSE)) {
+    log(ESP_LOG_VERBOSE, "Sent UDP reply: " + reply_string);
+  }
+
+  // Handle OTA (if not waiting for auth)
+  if (state.handshake_packet && !state.waiting_for_auth) {
+    if (!beginSession(UpdateSource::ARDUINO_OTA, 0)) {
+      return false; // Another update started since the invitation.
+    }
+    reportStatus(OtaStatus::UPDATE_STARTED);
+    auto result = connectToHostForArduino(*state.handshake_packet, addr_str);
+    endSession(result);
+    if (result) {
+      reportStatus(OtaStatus::UPDATE_COMPLETED);
+      vTaskDelay(2000 / portTICK_PERIOD_MS);
+      esp_restart();
+    } else {
+      reportStatus(OtaStatus::UPDATE_FAILED);
     }
+    return false; // Fail or OK, restart UDP.
   }
-  vTaskDelete(NULL);
+  return true;
 }
 
 /**
@@ -723,6 +1577,19 @@ bool OtaHelper::connectToHostForArduino(ArduinoOtaHandshake &update, char *host_
     log(ESP_LOG_ERROR, "Unable to create TCP client socket: errno " + std::to_string(errno));
     return false;
   }
+  auto &transfer = _configuration.transfer;
+  if (transfer.arduino_ota_rcvbuf > 0) {
+    int rcvbuf = transfer.arduino_ota_rcvbuf;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+      log(ESP_LOG_WARN,
+          "Failed to set TCP receive buffer size (CONFIG_LWIP_SO_RCVBUF?): errno " + std::to_string(errno));
+    }
+  }
+  if (transfer.arduino_ota_recv_timeout_ms > 0) {
+    struct timeval timeout = {.tv_sec = (time_t)(transfer.arduino_ota_recv_timeout_ms / 1000),
+                              .tv_usec = (suseconds_t)(transfer.arduino_ota_recv_timeout_ms % 1000 * 1000)};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
   log(ESP_LOG_INFO,
       "TCP client socket created, connecting to " + std::string(host_ip) + ":" + std::to_string(update.host_port));
 
@@ -771,15 +1638,19 @@ int OtaHelper::fillBuffer(int socket, char *buffer, size_t buffer_size, size_t t
     } else {
       total_read += read;
 
-      auto bytes_filled = std::to_string(read);
-      int err = send(socket, bytes_filled.c_str(), bytes_filled.size(), 0);
+      char bytes_filled[12];
+      int bytes_filled_len = snprintf(bytes_filled, sizeof(bytes_filled), "%d", read);
+      int err = send(socket, bytes_filled, bytes_filled_len, 0);
       if (err < 0) {
         log(ESP_LOG_ERROR, "Failed to ack when filling buffer.");
         return -1;
       }
       // Are we at the end?
-      log(ESP_LOG_VERBOSE, "Read " + bytes_filled + " bytes from socket, total_read: " + std::to_string(total_read) +
-                               ", total_bytes_left: " + std::to_string(total_bytes_left));
+      if (isLogEnabled(ESP_LOG_VERBOSE)) {
+        log(ESP_LOG_VERBOSE, "Read " + std::string(bytes_filled) + " bytes from socket, total_read: " +
+                                 std::to_string(total_read) + ", total_bytes_left: " +
+                                 std::to_string(total_bytes_left));
+      }
       if (total_read >= total_bytes_left) {
         return total_read;
       }
@@ -789,186 +1660,1665 @@ int OtaHelper::fillBuffer(int socket, char *buffer, size_t buffer_size, size_t t
 }
 
 // #########################################################################
-// ESP-IDF OTA generic
+// OTA via UDP multicast
 // #########################################################################
 
-bool OtaHelper::writeStreamToPartition(
-    const esp_partition_t *partition, FlashMode flash_mode, size_t content_length, std::string &md5hash,
-    std::function<int(char *buffer, size_t buffer_size, size_t total_bytes_left)> fill_buffer) {
-  char *buffer = (char *)malloc(SPI_FLASH_SEC_SIZE);
-  if (buffer == nullptr) {
-    log(ESP_LOG_ERROR, "Failed to allocate buffer of size " + std::to_string(SPI_FLASH_SEC_SIZE));
-    return false;
+void OtaHelper::multicastOtaTask(void *pvParameters) {
+  OtaHelper *_this = (OtaHelper *)pvParameters;
+
+  MulticastState state;
+  while (1) {
+    int sock = _this->openMulticastSocket(MULTICAST_RECV_TIMEOUT_MS);
+    if (sock < 0) {
+      _this->notifyReady(false);
+      break;
+    }
+    while (_this->handleMulticastPacket(sock, state)) {
+      _this->serviceMulticastSession(sock, state);
+    }
+    _this->log(ESP_LOG_ERROR, "Shutting down multicast UDP and restarting socket...");
+    shutdown(sock, 0);
+    close(sock);
   }
 
-  uint8_t skip_buffer[ENCRYPTED_BLOCK_SIZE];
+  if (state.session) {
+    _this->endMulticastSession(*state.session, false);
+  }
+  vTaskDelete(NULL);
+}
 
-  ConnectionHelperUtils::MD5Builder md5;
-  md5.begin();
+/**
+ * @brief Create and bind the multicast UDP socket and join the group.
+ *
+ * @param recv_timeout_ms receive timeout, 0 to block.
+ * @return the socket, or -1 on failure.
+ */
+int OtaHelper::openMulticastSocket(uint32_t recv_timeout_ms) {
+  auto &config = _configuration.multicast_ota;
+  struct sockaddr_in dest_addr_ip4 = {};
+  dest_addr_ip4.sin_addr.s_addr = htonl(INADDR_ANY);
+  dest_addr_ip4.sin_family = AF_INET;
+  dest_addr_ip4.sin_port = htons(config.port);
+
+  struct ip_mreq mreq = {};
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (inet_aton(config.group.c_str(), &mreq.imr_multiaddr) == 0 || !IN_MULTICAST(ntohl(mreq.imr_multiaddr.s_addr))) {
+    log(ESP_LOG_ERROR, "Invalid multicast group " + config.group);
+    return -1;
+  }
 
-  int bytes_read = 0;
-  while (bytes_read < content_length) {
-    int bytes_filled = fill_buffer(buffer, SPI_FLASH_SEC_SIZE, content_length - bytes_read);
-    if (bytes_filled < 0) {
-      log(ESP_LOG_ERROR, "Unable to fill buffer");
-      free(buffer);
-      return false;
-    }
+  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (sock < 0) {
+    log(ESP_LOG_ERROR, "Unable to create multicast UDP socket: errno " + std::to_string(errno));
+    return -1;
+  }
+
+  int reuse = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  int err = bind(sock, (struct sockaddr *)&dest_addr_ip4, sizeof(dest_addr_ip4));
+  if (err < 0) {
+    log(ESP_LOG_ERROR, "Multicast UDP socket unable to bind: errno " + std::to_string(errno));
+    close(sock);
+    return -1;
+  }
+  err = setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+  if (err < 0) {
+    log(ESP_LOG_ERROR, "Unable to join multicast group: errno " + std::to_string(errno));
+    close(sock);
+    return -1;
+  }
+  if (recv_timeout_ms > 0) {
+    // Wake up regularly to request missing blocks and to time out.
+    struct timeval timeout = {.tv_sec = (time_t)(recv_timeout_ms / 1000),
+                              .tv_usec = (suseconds_t)(recv_timeout_ms % 1000 * 1000)};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+  log(ESP_LOG_INFO, "Multicast UDP socket bound, group " + config.group + ":" + std::to_string(config.port));
+  onServiceStarted(MULTICAST_OTA_STARTED_BIT);
+  return sock;
+}
 
-    log(ESP_LOG_VERBOSE, "Filled buffer with: " + std::to_string(bytes_filled));
+/**
+ * @brief Receive and handle one multicast packet.
+ *
+ * @return false if the socket should be recreated.
+ */
+bool OtaHelper::handleMulticastPacket(int sock, MulticastState &state) {
+  char rx_buffer[sizeof(MulticastHeader) + MULTICAST_MAX_BLOCK_SIZE + MULTICAST_TAG_LEN];
+  struct sockaddr_storage source_addr;
+  socklen_t socklen = sizeof(source_addr);
+  int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer), 0, (struct sockaddr *)&source_addr, &socklen);
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true; // Receive timeout.
+  }
+  if (len < 0) {
+    log(ESP_LOG_ERROR, "Multicast UDP recvfrom failed: errno " + std::to_string(errno));
+    return false;
+  }
 
-    // Special start case
-    // Check start if contains the magic byte.
-    uint8_t skip = 0;
-    if (bytes_read == 0 && flash_mode == FlashMode::FIRMWARE) {
-      if (buffer[0] != ESP_IMAGE_HEADER_MAGIC) {
-        log(ESP_LOG_ERROR, "Start of firwmare does not contain magic byte");
-        free(buffer);
-        return false;
-      }
+  MulticastHeader header = {};
+  if (len >= (int)sizeof(header)) {
+    memcpy(&header, rx_buffer, sizeof(header));
+  }
+  if (header.magic != MULTICAST_MAGIC || header.session_id == state.ignored_session_id) {
+    return true;
+  }
 
-      // Stash the first 16/ENCRYPTED_BLOCK_SIZE bytes of data and set the offset so they are
-      // not written at this point so that partially written firmware
-      // will not be bootable
-      memcpy(skip_buffer, buffer, sizeof(skip_buffer));
-      skip += sizeof(skip_buffer);
+  auto &session = state.session;
+  const char *payload = rx_buffer + sizeof(header);
+  size_t payload_length = len - sizeof(header);
+  bool ok = true;
+  if (header.type == MULTICAST_ANNOUNCE && !session) {
+    session.emplace();
+    bool busy = false;
+    ok = beginMulticastSession(*session, rx_buffer, len, busy);
+    if (!ok) {
+      // If busy with another update, join on a later announcement instead.
+      if (!busy) {
+        state.ignored_session_id = header.session_id;
+      }
+      session.reset();
+    }
+  } else if (session && header.session_id == session->id && header.type != MULTICAST_ANNOUNCE) {
+    if (!authenticateMulticastPacket(*session, rx_buffer, len)) {
+      // Dropped without failing the session, so that injected packets can not abort it.
+      log(ESP_LOG_WARN, "Dropping multicast packet with invalid tag");
+      return true;
+    }
+    if (!_configuration.multicast_ota.password.empty()) {
+      payload_length -= MULTICAST_TAG_LEN;
+    }
+    if (header.type == MULTICAST_DATA) {
+      ok = writeMulticastBlock(*session, header.index, payload, payload_length);
+    } else if (header.type == MULTICAST_PARITY) {
+      ok = recoverMulticastBlock(*session, header.index, payload, payload_length);
+    } else if (header.type == MULTICAST_END) {
+      session->end_seen = true;
+      session->sender = source_addr;
     }
+    if (!ok) {
+      endMulticastSession(*session, false);
+      state.ignored_session_id = session->id;
+      session.reset();
+    }
+  }
+  return true;
+}
 
-    // Normal case - write buffer
-    if (!writeBufferToPartition(partition, bytes_read, buffer, bytes_filled, skip)) {
-      log(ESP_LOG_ERROR, "Failed to write buffer to partition");
-      free(buffer);
-      return false;
+/**
+ * @brief Complete, time out or request missing blocks for the ongoing session, if any. Called after each packet and
+ * at least every MULTICAST_RECV_TIMEOUT_MS.
+ */
+void OtaHelper::serviceMulticastSession(int sock, MulticastState &state) {
+  auto &session = state.session;
+  if (!session) {
+    return;
+  }
+  auto now = esp_timer_get_time();
+  if (session->blocks_received == session->block_count) {
+    auto success = finishMulticastSession(*session);
+    endMulticastSession(*session, success);
+    if (success) {
+      vTaskDelay(2000 / portTICK_PERIOD_MS);
+      esp_restart();
     }
+    state.ignored_session_id = session->id;
+    session.reset();
+  } else if (now - session->last_block_us > (int64_t)_configuration.multicast_ota.timeout_ms * 1000) {
+    log(ESP_LOG_ERROR, "Multicast OTA timed out with " +
+                           std::to_string(session->block_count - session->blocks_received) + " of " +
+                           std::to_string(session->block_count) + " blocks missing");
+    endMulticastSession(*session, false);
+    state.ignored_session_id = session->id;
+    session.reset();
+  } else if (session->end_seen && now - session->last_nack_us >= MULTICAST_NACK_INTERVAL_MS * 1000) {
+    sendMulticastNack(sock, *session);
+    session->last_nack_us = now;
+  }
+}
 
-    md5.add((uint8_t *)buffer, (uint16_t)bytes_filled);
-    bytes_read += bytes_filled;
+/**
+ * @brief Validate an announcement and start the session.
+ *
+ * @param busy set to true if failed only because another update is in progress.
+ */
+bool OtaHelper::beginMulticastSession(MulticastSession &session, const char *packet, size_t length, bool &busy) {
+  MulticastHeader header;
+  MulticastAnnounce announce;
+  if (length < sizeof(header) + sizeof(announce)) {
+    log(ESP_LOG_ERROR, "Multicast announcement too short");
+    return false;
+  }
+  memcpy(&header, packet, sizeof(header));
+  memcpy(&announce, packet + sizeof(header), sizeof(announce));
+
+  if (header.block_size < MULTICAST_MIN_BLOCK_SIZE || header.block_size > MULTICAST_MAX_BLOCK_SIZE ||
+      header.block_size % ENCRYPTED_BLOCK_SIZE != 0 || announce.group_size == 0 ||
+      announce.group_size > MULTICAST_MAX_GROUP_SIZE || announce.image_size == 0 || header.flash_mode > 1) {
+    log(ESP_LOG_ERROR, "Invalid multicast announcement, block size " + std::to_string(header.block_size) +
+                           ", group size " + std::to_string(announce.group_size) + ", image size " +
+                           std::to_string(announce.image_size));
+    return false;
+  }
 
-    // If this is the end, finish up.
-    if (bytes_read == content_length) {
-      log(ESP_LOG_INFO, "End of stream, writing data to partition");
+  std::string md5(announce.md5, sizeof(announce.md5));
+  auto &password = _configuration.multicast_ota.password;
+  if (!password.empty()) {
+    uint8_t tag[MULTICAST_TAG_LEN];
+    multicastTag(password, {std::string_view(packet, sizeof(header) + offsetof(MulticastAnnounce, token))}, tag);
+    char token[MULTICAST_TAG_LEN * 2 + 1];
+    ConnectionHelperUtils::toHex(tag, sizeof(tag), token);
+    if (!ConnectionHelperUtils::constantTimeEquals((const uint8_t *)token, (const uint8_t *)announce.token,
+                                                   sizeof(announce.token))) {
+      log(ESP_LOG_WARN, "Multicast authentication failed");
+      return false;
+    }
+  }
 
-      if (!md5hash.empty()) {
-        md5.calculate();
-        if (md5hash != md5.toString()) {
-          log(ESP_LOG_ERROR, "MD5 checksum verification failed.");
-          free(buffer);
-          return false;
-        } else {
-          log(ESP_LOG_INFO, "MD5 checksum correct.");
-        }
-      }
+  // Reject replayed announcements, which could otherwise downgrade to any image ever sent.
+  auto last_sequence = loadMulticastSequence();
+  if (announce.sequence <= last_sequence) {
+    log(ESP_LOG_WARN, "Multicast sequence " + std::to_string(announce.sequence) + " is not newer than last applied " +
+                          std::to_string(last_sequence) + ", ignoring");
+    return false;
+  }
 
-      if (flash_mode == FlashMode::FIRMWARE) {
-        auto r = esp_partition_write(partition, 0, (uint32_t *)skip_buffer, ENCRYPTED_BLOCK_SIZE);
-        if (!reportOnError(r, "Failed to enable partition")) {
-          free(buffer);
-          return false;
-        }
+  auto flash_mode = header.flash_mode == 0 ? FlashMode::FIRMWARE : FlashMode::SPIFFS;
+  auto *partition = findPartition(flash_mode);
+  if (partition == nullptr) {
+    log(ESP_LOG_ERROR, "Unable to find suitable partition");
+    return false;
+  }
+  if (announce.image_size > partition->size) {
+    log(ESP_LOG_ERROR, "Content length " + std::to_string(announce.image_size) + " is larger than partition size " +
+                           std::to_string(partition->size));
+    return false;
+  }
+  if (!beginSession(UpdateSource::MULTICAST, 0)) {
+    busy = true;
+    return false;
+  }
+  reportStatus(OtaStatus::UPDATE_STARTED);
+  log(ESP_LOG_INFO, "OTA started via multicast with target partition: " + std::string(partition->label));
+
+  session.id = header.session_id;
+  session.sequence = announce.sequence;
+  session.flash_mode = flash_mode;
+  session.partition = partition;
+  session.image_size = announce.image_size;
+  session.block_size = header.block_size;
+  session.group_size = announce.group_size;
+  session.block_count = (announce.image_size + header.block_size - 1) / header.block_size;
+  session.received.assign((session.block_count + 7) / 8, 0);
+  session.scratch.resize(2 * session.block_size);
+  session.md5 = md5;
+
+  // Erased as blocks arrive, as for streams. Blocks arrive mostly in order, and any block ahead erases the range up to
+  // it, so that lost blocks can be written later.
+  session.started_us = beginUpdate(partition, flash_mode);
+  session.last_block_us = session.started_us;
+  return true;
+}
 
-        r = partitionIsBootable(partition);
-        if (!reportOnError(r, "Partition is not bootable")) {
-          free(buffer);
-          return false;
-        }
+bool OtaHelper::writeMulticastBlock(MulticastSession &session, uint32_t index, const char *data, size_t length) {
+  if (index >= session.block_count) {
+    log(ESP_LOG_ERROR, "Multicast block " + std::to_string(index) + " out of range");
+    return false;
+  }
+  size_t offset = (size_t)index * session.block_size;
+  if (length != std::min((size_t)session.block_size, session.image_size - offset)) {
+    log(ESP_LOG_ERROR, "Multicast block " + std::to_string(index) + " has unexpected length " + std::to_string(length));
+    return false;
+  }
+  session.last_block_us = esp_timer_get_time();
+  if (session.received[index / 8] & (1 << (index % 8))) {
+    return true; // Duplicate, e.g. resent on request of another device.
+  }
 
-        r = esp_ota_set_boot_partition(partition);
-        if (!reportOnError(r, "Failed to set partition as bootable")) {
-          free(buffer);
-          return false;
-        }
-      }
+  uint8_t skip = 0;
+  if (index == 0 && session.flash_mode == FlashMode::FIRMWARE) {
+    if (!validateImageHeader((const uint8_t *)data, length)) {
+      return false;
     }
-
-    vTaskDelay(0); // Yield/reschedule
+    // Same as for streams, hold back the first bytes until complete so that a partial firmware is not bootable.
+    memcpy(session.skip_buffer, data, sizeof(session.skip_buffer));
+    skip += sizeof(session.skip_buffer);
   }
 
-  free(buffer);
+  if (!writeBufferToPartition(session.partition, offset, data, length, skip)) {
+    log(ESP_LOG_ERROR, "Failed to write buffer to partition");
+    return false;
+  }
+  session.received[index / 8] |= 1 << (index % 8);
+  session.blocks_received++;
+  _update_statistics.bytes_written += length;
+  _update_statistics.duration_ms = (esp_timer_get_time() - session.started_us) / 1000;
   return true;
 }
 
-bool OtaHelper::writeBufferToPartition(const esp_partition_t *partition, size_t bytes_written, char *buffer,
-                                       size_t buffer_size, uint8_t skip) {
+/**
+ * @brief Recover the one missing block of a group, if only one is missing, by XOR of the parity with the other blocks
+ * of the group as read back from flash. Blocks are zero padded to the block size.
+ */
+bool OtaHelper::recoverMulticastBlock(MulticastSession &session, uint32_t group, const char *parity, size_t length) {
+  uint32_t first = group * session.group_size;
+  if (first >= session.block_count || length != session.block_size) {
+    log(ESP_LOG_ERROR, "Invalid multicast parity for group " + std::to_string(group));
+    return false;
+  }
+  uint32_t last = std::min(first + session.group_size, session.block_count);
 
-  size_t offset = partition->address + bytes_written;
-  bool block_erase =
-      (buffer_size - bytes_written >= SPI_FLASH_BLOCK_SIZE) &&
-      (offset % SPI_FLASH_BLOCK_SIZE == 0); // if it's the block boundary, than erase the whole block from here
-  bool part_head_sectors = partition->address % SPI_FLASH_BLOCK_SIZE &&
-                           offset < (partition->address / SPI_FLASH_BLOCK_SIZE + 1) *
-                                        SPI_FLASH_BLOCK_SIZE; // sector belong to unaligned partition heading block
-  bool part_tail_sectors = offset >= (partition->address + buffer_size) / SPI_FLASH_BLOCK_SIZE *
-                                         SPI_FLASH_BLOCK_SIZE; // sector belong to unaligned partition tailing block
-  if (block_erase || part_head_sectors || part_tail_sectors) {
-    esp_err_t r =
-        esp_partition_erase_range(partition, bytes_written, block_erase ? SPI_FLASH_BLOCK_SIZE : SPI_FLASH_SEC_SIZE);
-    if (!reportOnError(r, "Failed to erase range")) {
-      return false;
+  std::optional<uint32_t> missing;
+  for (uint32_t index = first; index < last; index++) {
+    if (!(session.received[index / 8] & (1 << (index % 8)))) {
+      if (missing) {
+        return true; // More than one missing, requested from the sender later.
+      }
+      missing = index;
     }
   }
+  if (!missing) {
+    return true;
+  }
 
-  // try to skip empty blocks on unecrypted partitions
-  if (partition->encrypted || checkDataInBlock((uint8_t *)buffer + skip / sizeof(uint32_t), bytes_written - skip)) {
-    auto r = esp_partition_write(partition, bytes_written + skip, (uint32_t *)buffer + skip / sizeof(uint32_t),
-                                 buffer_size - skip);
-    if (!reportOnError(r, "Failed to write range")) {
+  uint8_t *recovered = session.scratch.data();
+  uint8_t *block = recovered + session.block_size;
+  memcpy(recovered, parity, session.block_size);
+  for (uint32_t index = first; index < last; index++) {
+    if (index == *missing) {
+      continue;
+    }
+    size_t offset = (size_t)index * session.block_size;
+    size_t block_length = std::min((size_t)session.block_size, session.image_size - offset);
+    auto r = esp_partition_read(session.partition, offset, block, block_length);
+    if (!reportOnError(r, "Failed to read block for recovery")) {
       return false;
     }
+    if (index == 0 && session.flash_mode == FlashMode::FIRMWARE) {
+      memcpy(block, session.skip_buffer, sizeof(session.skip_buffer));
+    }
+    for (size_t i = 0; i < block_length; i++) {
+      recovered[i] ^= block[i];
+    }
   }
 
-  return true;
+  if (isLogEnabled(ESP_LOG_VERBOSE)) {
+    log(ESP_LOG_VERBOSE, "Recovered multicast block " + std::to_string(*missing) + " from parity");
+  }
+  size_t offset = (size_t)*missing * session.block_size;
+  return writeMulticastBlock(session, *missing, (const char *)recovered,
+                             std::min((size_t)session.block_size, session.image_size - offset));
 }
 
-esp_err_t OtaHelper::partitionIsBootable(const esp_partition_t *partition) {
-  uint8_t buf[ENCRYPTED_BLOCK_SIZE];
-  if (!partition) {
-    return ESP_ERR_INVALID_ARG;
+/**
+ * @brief Request missing blocks from the sender, which resends them unicast.
+ */
+void OtaHelper::sendMulticastNack(int sock, MulticastSession &session) {
+  std::vector<uint32_t> missing;
+  for (uint32_t index = 0; index < session.block_count && missing.size() < MULTICAST_MAX_NACK_BLOCKS; index++) {
+    if (!(session.received[index / 8] & (1 << (index % 8)))) {
+      missing.push_back(index);
+    }
   }
-
-  esp_err_t r = esp_partition_read(partition, 0, (uint32_t *)buf, ENCRYPTED_BLOCK_SIZE);
-  if (r != ESP_OK) {
-    return r;
+  log(ESP_LOG_INFO, "Requesting " + std::to_string(missing.size()) + " of " +
+                        std::to_string(session.block_count - session.blocks_received) + " missing multicast blocks");
+
+  MulticastHeader header = {};
+  header.magic = MULTICAST_MAGIC;
+  header.type = MULTICAST_NACK;
+  header.flash_mode = session.flash_mode == FlashMode::FIRMWARE ? 0 : 1;
+  header.block_size = session.block_size;
+  header.session_id = session.id;
+  header.index = missing.size();
+
+  std::vector<char> packet(sizeof(header) + missing.size() * sizeof(uint32_t));
+  memcpy(packet.data(), &header, sizeof(header));
+  memcpy(packet.data() + sizeof(header), missing.data(), missing.size() * sizeof(uint32_t));
+  int err = sendto(sock, packet.data(), packet.size(), 0, (struct sockaddr *)&session.sender, sizeof(sockaddr_in));
+  if (err < 0) {
+    log(ESP_LOG_WARN, "Failed to request missing multicast blocks: errno " + std::to_string(errno));
   }
+}
 
-  if (buf[0] != ESP_IMAGE_HEADER_MAGIC) {
-    return ESP_ERR_INVALID_CRC;
+bool OtaHelper::finishMulticastSession(MulticastSession &session) {
+  log(ESP_LOG_INFO, "All multicast blocks received, verifying");
+  // Blocks are written out of order, so the MD5 is always calculated from flash, regardless of Verification::readback.
+  bool success = commitUpdate(session.partition, session.flash_mode, session.skip_buffer, session.started_us,
+                              [this, &session]() {
+                                ConnectionHelperUtils::MD5Builder md5;
+                                md5.begin();
+                                if (!forEachMappedWindow(session.partition, session.image_size,
+                                                         [&md5](const uint8_t *data, size_t length) {
+                                                           md5.add(data, length);
+                                                           return true;
+                                                         })) {
+                                  return false;
+                                }
+                                md5.calculate();
+                                if (!md5.equals(session.md5)) {
+                                  log(ESP_LOG_ERROR, "MD5 checksum verification failed.");
+                                  return false;
+                                }
+                                log(ESP_LOG_INFO, "MD5 checksum correct.");
+                                return true;
+                              });
+  // Stored only once applied, so that a transmission that failed can be retried with the same sequence. Failing to
+  // store does not fail the update, as the boot partition is already set.
+  if (success) {
+    storeMulticastSequence(session.sequence);
+    log(ESP_LOG_INFO, "Multicast OTA complete, rebooting...");
   }
-  return ESP_OK;
+  return success;
 }
 
-bool OtaHelper::checkDataInBlock(const uint8_t *data, size_t len) {
-  // check 32-bit aligned blocks only
-  if (!len || len % sizeof(uint32_t))
+void OtaHelper::endMulticastSession(MulticastSession &session, bool success) {
+  endUpdate();
+  reportStatus(success ? OtaStatus::UPDATE_COMPLETED : OtaStatus::UPDATE_FAILED);
+  endSession(success);
+}
+
+/**
+ * @brief Check the tag at the end of a DATA, PARITY or END packet, if a password is set. The tag covers the session
+ * sequence as well, so that packets of earlier sessions with the same id are rejected.
+ */
+bool OtaHelper::authenticateMulticastPacket(const MulticastSession &session, const char *packet, size_t length) {
+  auto &password = _configuration.multicast_ota.password;
+  if (password.empty()) {
     return true;
+  }
+  if (length < sizeof(MulticastHeader) + MULTICAST_TAG_LEN) {
+    return false;
+  }
+  size_t tagged_length = length - MULTICAST_TAG_LEN;
+  uint8_t tag[MULTICAST_TAG_LEN];
+  multicastTag(password,
+               {std::string_view((const char *)&session.sequence, sizeof(session.sequence)),
+                std::string_view(packet, tagged_length)},
+               tag);
+  return ConnectionHelperUtils::constantTimeEquals(tag, (const uint8_t *)packet + tagged_length, sizeof(tag));
+}
 
-  size_t dwl = len / sizeof(uint32_t);
+/**
+ * @brief Sequence of the last applied multicast session, 0 if none.
+ */
+uint32_t OtaHelper::loadMulticastSequence() {
+  nvs_handle_t handle;
+  if (nvs_open(MULTICAST_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return 0; // Nothing stored yet.
+  }
+  uint32_t sequence = 0;
+  nvs_get_u32(handle, MULTICAST_NVS_SEQUENCE_KEY, &sequence);
+  nvs_close(handle);
+  return sequence;
+}
 
-  do {
-    if (*(uint32_t *)data ^ 0xffffffff) // for SPI NOR flash empty blocks are all one's, i.e. filled with 0xff byte
-      return true;
+bool OtaHelper::storeMulticastSequence(uint32_t sequence) {
+  nvs_handle_t handle;
+  if (!reportOnError(nvs_open(MULTICAST_NVS_NAMESPACE, NVS_READWRITE, &handle), "Failed to open NVS")) {
+    return false;
+  }
+  auto r = nvs_set_u32(handle, MULTICAST_NVS_SEQUENCE_KEY, sequence);
+  if (r == ESP_OK) {
+    r = nvs_commit(handle);
+  }
+  nvs_close(handle);
+  return reportOnError(r, "Failed to store multicast sequence");
+}
+
+// #########################################################################
+// OTA sink
+// #########################################################################
+
+OtaHelper::OtaSink::OtaSink(OtaHelper &ota_helper, bool owns_session) : _ota(ota_helper), _owns_session(owns_session) {}
+
+OtaHelper::OtaSink::~OtaSink() {
+  if (_active) {
+    abort();
+  }
+}
+
+bool OtaHelper::OtaSink::begin(FlashMode flash_mode, size_t size, std::string md5_hash) {
+  auto *partition = _ota.findPartition(flash_mode);
+  if (partition == nullptr) {
+    _ota.log(ESP_LOG_ERROR, "Unable to find suitable partition");
+    return false;
+  }
+  return begin(partition, flash_mode, size, md5_hash);
+}
+
+bool OtaHelper::OtaSink::begin(const esp_partition_t *partition, FlashMode flash_mode, size_t size,
+                               std::string md5_hash) {
+  if (_active) {
+    _ota.log(ESP_LOG_ERROR, "Update already started");
+    return false;
+  }
+  if (size == 0) {
+    _ota.log(ESP_LOG_ERROR, "No content to write");
+    return false;
+  }
+  if (size != UNKNOWN_SIZE && size > partition->size) {
+    _ota.log(ESP_LOG_ERROR, "Content length " + std::to_string(size) + " is larger than partition size " +
+                                std::to_string(partition->size));
+    return false;
+  }
+  if (!md5_hash.empty() && md5_hash.length() != 32) {
+    _ota.log(ESP_LOG_ERROR, "MD5 is not correct length. Expected length: 32, got " + std::to_string(md5_hash.length()));
+    return false;
+  }
+  if (!_md5) {
+    _md5.reset(new (std::nothrow) ConnectionHelperUtils::MD5Builder());
+    if (!_md5) {
+      _ota.log(ESP_LOG_ERROR, "Failed to allocate MD5 builder");
+      return false;
+    }
+  }
+  if (_owns_session) {
+    if (!_ota.beginSession(UpdateSource::SINK, 0)) {
+      return false;
+    }
+    _ota.reportStatus(OtaStatus::UPDATE_STARTED);
+    _ota.log(ESP_LOG_INFO, "OTA started via sink with target partition: " + std::string(partition->label));
+  }
+
+  _buffer = _ota.acquireUpdateBuffer();
+  if (_buffer == nullptr) {
+    _ota.log(ESP_LOG_ERROR, "Failed to allocate buffer of size " + std::to_string(_ota._chunk_size));
+    if (_owns_session) {
+      _ota.reportStatus(OtaStatus::UPDATE_FAILED);
+      _ota.endSession(false);
+    }
+    return false;
+  }
+
+  _active = true;
+  _partition = partition;
+  _flash_mode = flash_mode;
+  _size = size;
+  _limit = size == UNKNOWN_SIZE ? partition->size : size;
+  _md5_hash = md5_hash;
+  _received = 0;
+  _written = 0;
+  _buffered = 0;
+  _md5->begin();
+
+  _started_us = _ota.beginUpdate(partition, flash_mode);
+  return true;
+}
+
+bool OtaHelper::OtaSink::write(const uint8_t *data, size_t length) {
+  if (!_active) {
+    _ota.log(ESP_LOG_ERROR, "No update in progress");
+    return false;
+  }
+  if (length > _limit - _received) {
+    _ota.log(ESP_LOG_ERROR, "Got more data than expected size " + std::to_string(_limit));
+    end(false);
+    return false;
+  }
+  _received += length;
+
+  const char *next = (const char *)data;
+  size_t chunk_size = _ota._chunk_size;
+  while (length > 0) {
+    // Write whole sectors directly, if nothing is buffered and at least a chunk is given.
+    if (_buffered == 0 && length >= chunk_size) {
+      size_t direct = length - length % SPI_FLASH_SEC_SIZE;
+      if (!writeChunk(next, direct)) {
+        end(false);
+        return false;
+      }
+      next += direct;
+      length -= direct;
+      continue;
+    }
+
+    size_t to_buffer = std::min(length, chunk_size - _buffered);
+    memcpy(_buffer + _buffered, next, to_buffer);
+    _buffered += to_buffer;
+    next += to_buffer;
+    length -= to_buffer;
+    if (_buffered == chunk_size) {
+      _buffered = 0;
+      if (!writeChunk(_buffer, chunk_size)) {
+        end(false);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Fill the internal buffer directly from a pull style source and write it, so that no second buffer is needed.
+ */
+int OtaHelper::OtaSink::writeFrom(
+    std::function<int(char *buffer, size_t buffer_size, size_t total_bytes_left)> &fill_buffer) {
+  int bytes_filled = fill_buffer(_buffer, _ota._chunk_size, _limit - _received);
+  if (bytes_filled < 0) {
+    _ota.log(ESP_LOG_ERROR, "Unable to fill buffer");
+    end(false);
+    return -1;
+  }
+  if (bytes_filled == 0) {
+    if (_size == UNKNOWN_SIZE) {
+      return 0;
+    }
+    _ota.log(ESP_LOG_ERROR, "Stream ended after " + std::to_string(_received) + " bytes, expected " +
+                                std::to_string(_size));
+    end(false);
+    return -1;
+  }
+  if (_ota.isLogEnabled(ESP_LOG_VERBOSE)) {
+    _ota.log(ESP_LOG_VERBOSE, "Filled buffer with: " + std::to_string(bytes_filled));
+  }
+  if ((size_t)bytes_filled > _limit - _received) {
+    _ota.log(ESP_LOG_ERROR, "Got more data than expected size " + std::to_string(_limit));
+    end(false);
+    return -1;
+  }
+
+  _received += bytes_filled;
+  if (!writeChunk(_buffer, bytes_filled)) {
+    end(false);
+    return -1;
+  }
+  return bytes_filled;
+}
+
+bool OtaHelper::OtaSink::writeChunk(const char *data, size_t length) {
+  // Special start case
+  uint8_t skip = 0;
+  if (_written == 0 && _flash_mode == FlashMode::FIRMWARE) {
+    if (!_ota.validateImageHeader((const uint8_t *)data, length)) {
+      return false;
+    }
+
+    // Stash the first 16/ENCRYPTED_BLOCK_SIZE bytes of data and set the offset so they are
+    // not written at this point so that partially written firmware
+    // will not be bootable
+    memcpy(_skip_buffer, data, sizeof(_skip_buffer));
+    skip += sizeof(_skip_buffer);
+  }
+
+  if (!_ota.writeBufferToPartition(_partition, _written, data, length, skip)) {
+    _ota.log(ESP_LOG_ERROR, "Failed to write buffer to partition");
+    return false;
+  }
+
+  _md5->add((const uint8_t *)data, length);
+  _written += length;
+  _ota._update_statistics.bytes_written = _written;
+  _ota._update_statistics.duration_ms = (esp_timer_get_time() - _started_us) / 1000;
+
+  _ota.paceStream(_started_us, _written);
+  vTaskDelay(0); // Yield/reschedule
+  return true;
+}
+
+bool OtaHelper::OtaSink::finish() {
+  if (!_active) {
+    _ota.log(ESP_LOG_ERROR, "No update in progress");
+    return false;
+  }
+  if ((_size != UNKNOWN_SIZE && _received != _size) || _received == 0) {
+    _ota.log(ESP_LOG_ERROR, "Got " + std::to_string(_received) + " bytes, expected " +
+                                (_size != UNKNOWN_SIZE ? std::to_string(_size) : std::string("more")) + " bytes");
+    end(false);
+    return false;
+  }
+  if (_buffered > 0) {
+    size_t length = _buffered;
+    _buffered = 0;
+    if (!writeChunk(_buffer, length)) {
+      end(false);
+      return false;
+    }
+  }
+  _ota.log(ESP_LOG_INFO, "End of stream, writing data to partition");
+
+  _md5->calculate();
+  if (!_md5_hash.empty()) {
+    if (!_md5->equals(_md5_hash)) {
+      _ota.log(ESP_LOG_ERROR, "MD5 checksum verification failed.");
+      end(false);
+      return false;
+    } else {
+      _ota.log(ESP_LOG_INFO, "MD5 checksum correct.");
+    }
+  }
+
+  auto &verification = _ota._configuration.verification;
+  bool success = _ota.commitUpdate(_partition, _flash_mode, _skip_buffer, _started_us, [this, &verification]() {
+    return !verification.readback ||
+           _ota.verifyPartitionData(_partition, _received, _md5->digest(), _md5->digestLength());
+  });
+  end(success);
+  return success;
+}
+
+void OtaHelper::OtaSink::abort() {
+  if (_active) {
+    _ota.log(ESP_LOG_WARN, "Update aborted after " + std::to_string(_received) + " bytes");
+    end(false);
+  }
+}
+
+void OtaHelper::OtaSink::end(bool success) {
+  _active = false;
+  _ota.releaseUpdateBuffer(_buffer);
+  _buffer = nullptr;
+  _ota.endUpdate();
+  if (_owns_session) {
+    _ota.reportStatus(success ? OtaStatus::UPDATE_COMPLETED : OtaStatus::UPDATE_FAILED);
+    _ota.endSession(success);
+  }
+}
+
+// #########################################################################
+// ESP-IDF OTA generic
+// #########################################################################
+
+/**
+ * @brief Set up statistics, pre-erased range and power mode for writing an update to partition. The session must be
+ * held. Shared by OtaSink and multicast.
+ *
+ * @return start time of the update.
+ */
+int64_t OtaHelper::beginUpdate(const esp_partition_t *partition, FlashMode flash_mode) {
+  _update_in_progress = true;
+  _update_statistics = {};
+  _update_statistics.session_id = _session_id;
+  _update_statistics.source = _session_source;
+  _update_statistics.chunk_size = _chunk_size;
+  _erased_until = flash_mode == FlashMode::FIRMWARE ? claimPreErased(partition) : 0;
+  _flash_busy_since_yield_us = 0;
+  enterUpdatePowerMode();
+  return esp_timer_get_time();
+}
+
+/**
+ * @brief Complete an update once all data is written: write the held back first bytes of a firmware, verify the
+ * written data using verify_written, verify the app image as configured and set the boot partition.
+ */
+bool OtaHelper::commitUpdate(const esp_partition_t *partition, FlashMode flash_mode, const uint8_t *skip_buffer,
+                             int64_t started_us, const std::function<bool()> &verify_written) {
+  if (flash_mode == FlashMode::FIRMWARE) {
+    auto r = esp_partition_write(partition, 0, skip_buffer, ENCRYPTED_BLOCK_SIZE);
+    if (!reportOnError(r, "Failed to enable partition")) {
+      return false;
+    }
+  }
+
+  if (!verify_written()) {
+    return false;
+  }
+
+  if (flash_mode == FlashMode::FIRMWARE) {
+    if (_configuration.verification.verify_app_image && !verifyAppImage(partition)) {
+      return false;
+    }
+
+    auto r = partitionIsBootable(partition);
+    if (!reportOnError(r, "Partition is not bootable")) {
+      return false;
+    }
+
+    r = esp_ota_set_boot_partition(partition);
+    if (!reportOnError(r, "Failed to set partition as bootable")) {
+      return false;
+    }
+  }
+
+  auto &stats = _update_statistics;
+  stats.duration_ms = (esp_timer_get_time() - started_us) / 1000;
+  log(ESP_LOG_INFO, "Session " + std::to_string(stats.session_id) + ": wrote " + std::to_string(stats.bytes_written) +
+                        " bytes in " + std::to_string(stats.duration_ms) + "ms, flash busy " +
+                        std::to_string(stats.flash_busy_ms) + "ms, worst stall " +
+                        std::to_string(stats.max_flash_stall_us) + "us, throttled " +
+                        std::to_string(stats.throttled_ms) + "ms, staging peak " +
+                        std::to_string(stats.staging_peak_bytes) + " bytes");
+  return true;
+}
+
+/**
+ * @brief Counterpart of beginUpdate(), on success or failure.
+ */
+void OtaHelper::endUpdate() {
+  exitUpdatePowerMode();
+  _update_in_progress = false;
+  onActivity();
+}
+
+bool OtaHelper::writeStreamToPartition(
+    const esp_partition_t *partition, FlashMode flash_mode, size_t content_length, std::string &md5hash,
+    std::function<int(char *buffer, size_t buffer_size, size_t total_bytes_left)> fill_buffer) {
+  OtaSink sink(*this, false); // Session is held by the transport.
+  if (!sink.begin(partition, flash_mode, content_length, md5hash)) {
+    return false;
+  }
+
+  bool success;
+  if (_configuration.staging.size / _chunk_size >= 2) {
+    success = writeStreamToSinkStaged(sink, fill_buffer);
+  } else {
+    success = writeStreamToSink(sink, fill_buffer);
+  }
+  return success && sink.finish();
+}
+
+bool OtaHelper::writeStreamToSink(
+    OtaSink &sink, std::function<int(char *buffer, size_t buffer_size, size_t total_bytes_left)> &fill_buffer) {
+  while (sink._size == OtaSink::UNKNOWN_SIZE || sink.bytesReceived() < sink._size) {
+    int bytes_filled = sink.writeFrom(fill_buffer);
+    if (bytes_filled < 0) {
+      return false;
+    } else if (bytes_filled == 0) {
+      break; // End of stream of unknown size.
+    }
+  }
+  return true;
+}
+
+struct OtaHelper::StagingContext {
+  struct Chunk {
+    uint16_t slot;
+    int length; // As returned by fill_buffer, negative on error.
+  };
+
+  OtaHelper *ota;
+  // Not copied, as copying may allocate.
+  std::function<int(char *buffer, size_t buffer_size, size_t total_bytes_left)> *fill_buffer;
+  size_t content_length; // Max length if unknown_length.
+  bool unknown_length;
+  char *ring;
+  QueueHandle_t free_slots;
+  QueueHandle_t filled_slots;
+  SemaphoreHandle_t done;
+  std::atomic<bool> abort = false;
+};
+
+bool OtaHelper::writeStreamToSinkStaged(
+    OtaSink &sink, std::function<int(char *buffer, size_t buffer_size, size_t total_bytes_left)> &fill_buffer) {
+  size_t slots = _configuration.staging.size / _chunk_size;
+  char *ring = _staging_buffer != nullptr ? _staging_buffer : allocateStagingBuffer(slots * _chunk_size);
+  if (ring == nullptr) {
+    log(ESP_LOG_WARN, "Writing update without staging");
+    return writeStreamToSink(sink, fill_buffer);
+  }
+
+  StagingContext ctx;
+  ctx.ota = this;
+  ctx.fill_buffer = &fill_buffer;
+  ctx.content_length = sink._limit;
+  ctx.unknown_length = sink._size == OtaSink::UNKNOWN_SIZE;
+  ctx.ring = ring;
+  bool reserved = _staging_free_slots != nullptr;
+  if (reserved) {
+    // Left with free slots by the previous update.
+    xQueueReset(_staging_free_slots);
+    xQueueReset(_staging_filled_slots);
+    ctx.free_slots = _staging_free_slots;
+    ctx.filled_slots = _staging_filled_slots;
+    ctx.done = _staging_done;
+  } else {
+    ctx.free_slots = xQueueCreate(slots, sizeof(uint16_t));
+    ctx.filled_slots = xQueueCreate(slots, sizeof(StagingContext::Chunk));
+    ctx.done = xSemaphoreCreateBinary();
+  }
+
+  bool success = false;
+  if (ctx.free_slots == nullptr || ctx.filled_slots == nullptr || ctx.done == nullptr) {
+    log(ESP_LOG_ERROR, "Failed to create staging queues");
+  } else {
+    for (uint16_t slot = 0; slot < slots; slot++) {
+      xQueueSend(ctx.free_slots, &slot, 0);
+    }
+
+    bool started;
+    auto &config = _configuration.staging;
+    if (reserved && _staging_task_storage.tcb != nullptr) {
+      // Kept running, as a static task that deleted itself can not be recreated in the same storage until the idle
+      // task has cleaned it up.
+      if (!_staging_worker_started) {
+        _staging_worker_started = createTask(stagingWorkerTask, "ota_stage", config.task_stack_size,
+                                             config.task_priority, config.task_core_id, _staging_task_storage);
+      }
+      StagingContext *work = &ctx;
+      started = _staging_worker_started && xQueueSend(_staging_work, &work, 0) == pdTRUE;
+    } else {
+      TaskStorage storage; // Not reserved, so created on the heap and freed once deleted.
+      started = createTask(stagingTask, "ota_stage", config.task_stack_size, config.task_priority, config.task_core_id,
+                           storage, &ctx);
+    }
+    if (started) {
+      // Write directly from the ring, the sink only copies if not a whole sector.
+      success = true;
+      while (success && (ctx.unknown_length || sink.bytesReceived() < sink._size)) {
+        StagingContext::Chunk chunk;
+        xQueueReceive(ctx.filled_slots, &chunk, portMAX_DELAY);
+        if (chunk.length == 0) {
+          xQueueSend(ctx.free_slots, &chunk.slot, 0);
+          break; // End of stream of unknown length.
+        }
+        success = chunk.length > 0 &&
+                  sink.write((const uint8_t *)ctx.ring + chunk.slot * _chunk_size, chunk.length);
+        xQueueSend(ctx.free_slots, &chunk.slot, 0);
+      }
+
+      // On failure the receiving task might still be waiting for a free slot, so keep freeing slots until it is done.
+      ctx.abort = true;
+      while (xSemaphoreTake(ctx.done, pdMS_TO_TICKS(10)) != pdTRUE) {
+        StagingContext::Chunk chunk;
+        while (xQueueReceive(ctx.filled_slots, &chunk, 0) == pdTRUE) {
+          xQueueSend(ctx.free_slots, &chunk.slot, 0);
+        }
+      }
+    }
+  }
+
+  if (!reserved && ctx.free_slots != nullptr) {
+    vQueueDelete(ctx.free_slots);
+  }
+  if (!reserved && ctx.filled_slots != nullptr) {
+    vQueueDelete(ctx.filled_slots);
+  }
+  if (!reserved && ctx.done != nullptr) {
+    vSemaphoreDelete(ctx.done);
+  }
+  if (ring != _staging_buffer) {
+    heap_caps_free(ring);
+  }
+  return success;
+}
+
+void OtaHelper::stagingTask(void *pvParameters) {
+  StagingContext *ctx = (StagingContext *)pvParameters;
+  ctx->ota->receiveStaged(*ctx);
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Persistent staging task, with static_allocation. Receives each update handed over through _staging_work.
+ */
+void OtaHelper::stagingWorkerTask(void *pvParameters) {
+  OtaHelper *_this = (OtaHelper *)pvParameters;
+  while (1) {
+    StagingContext *ctx;
+    xQueueReceive(_this->_staging_work, &ctx, portMAX_DELAY);
+    _this->receiveStaged(*ctx);
+  }
+}
+
+/**
+ * @brief Receive into free slots of the ring until the end of the stream, an error or abort. Gives ctx.done when done.
+ */
+void OtaHelper::receiveStaged(StagingContext &ctx) {
+  size_t received = 0;
+  while (ctx.unknown_length || received < ctx.content_length) {
+    StagingContext::Chunk chunk;
+    xQueueReceive(ctx.free_slots, &chunk.slot, portMAX_DELAY);
+    if (ctx.abort) {
+      break;
+    }
+
+    size_t bytes_left = received < ctx.content_length ? ctx.content_length - received : 0;
+    chunk.length = (*ctx.fill_buffer)(ctx.ring + chunk.slot * _chunk_size, _chunk_size, bytes_left);
+    if (chunk.length == 0 && !ctx.unknown_length) {
+      log(ESP_LOG_ERROR, "Stream ended after " + std::to_string(received) + " bytes, expected " +
+                             std::to_string(ctx.content_length));
+      chunk.length = -1;
+    }
+    xQueueSend(ctx.filled_slots, &chunk, portMAX_DELAY);
+    if (chunk.length <= 0) {
+      break;
+    }
+    received += chunk.length;
+
+    size_t staged = uxQueueMessagesWaiting(ctx.filled_slots) * _chunk_size;
+    if (staged > _update_statistics.staging_peak_bytes) {
+      _update_statistics.staging_peak_bytes = staged;
+    }
+  }
+
+  xSemaphoreGive(ctx.done);
+}
+
+/**
+ * @brief Create the staging queues and semaphore once, for static_allocation. Reused by each update.
+ */
+bool OtaHelper::reserveStagingQueues(size_t slots) {
+  size_t free_slots_size = slots * sizeof(uint16_t);
+  size_t filled_slots_size = slots * sizeof(StagingContext::Chunk);
+  auto *storage =
+      (uint8_t *)heap_caps_malloc(free_slots_size + filled_slots_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (storage == nullptr) {
+    log(ESP_LOG_ERROR, "Failed to reserve staging queues");
+    return false;
+  }
+  _staging_free_slots = xQueueCreateStatic(slots, sizeof(uint16_t), storage, &_staging_free_slots_buffer);
+  _staging_filled_slots = xQueueCreateStatic(slots, sizeof(StagingContext::Chunk), storage + free_slots_size,
+                                             &_staging_filled_slots_buffer);
+  _staging_done = xSemaphoreCreateBinaryStatic(&_staging_done_buffer);
+  _staging_work = xQueueCreateStatic(1, sizeof(StagingContext *), (uint8_t *)_staging_work_storage,
+                                     &_staging_work_buffer);
+  return true;
+}
+
+char *OtaHelper::allocateStagingBuffer(size_t size) {
+  char *buffer = (char *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (buffer != nullptr) {
+    log(ESP_LOG_INFO, "Allocated staging buffer of size " + std::to_string(size) + " in PSRAM");
+    return buffer;
+  }
+  buffer = (char *)heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (buffer != nullptr) {
+    log(ESP_LOG_INFO, "Allocated staging buffer of size " + std::to_string(size) + " in internal RAM");
+    return buffer;
+  }
+  log(ESP_LOG_WARN, "Failed to allocate staging buffer of size " + std::to_string(size));
+  return nullptr;
+}
+
+bool OtaHelper::writeBufferToPartition(const esp_partition_t *partition, size_t bytes_written, const char *buffer,
+                                       size_t buffer_size, uint8_t skip) {
+  if (!eraseUpTo(partition, bytes_written + buffer_size)) {
+    return false;
+  }
+
+  // try to skip empty blocks on unecrypted partitions
+  if (partition->encrypted || checkDataInBlock((const uint8_t *)buffer + skip, buffer_size - skip)) {
+    // Encrypted writes must be whole 16 byte blocks, so pad an unaligned tail with 0xFF (as erased). All other writes
+    // are chunks (or multicast blocks), so are aligned.
+    size_t length = buffer_size - skip;
+    size_t tail = partition->encrypted ? length % ENCRYPTED_BLOCK_SIZE : 0;
+    auto started_us = esp_timer_get_time();
+    esp_err_t r = ESP_OK;
+    if (length > tail) {
+      r = esp_partition_write(partition, bytes_written + skip, buffer + skip, length - tail);
+    }
+    if (r == ESP_OK && tail > 0) {
+      uint8_t padded[ENCRYPTED_BLOCK_SIZE];
+      memset(padded, 0xFF, sizeof(padded));
+      memcpy(padded, buffer + buffer_size - tail, tail);
+      r = esp_partition_write(partition, bytes_written + buffer_size - tail, padded, sizeof(padded));
+    }
+    onFlashOperationDone(started_us);
+    if (!reportOnError(r, "Failed to write range")) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Erase partition from what has been erased so far up to end (relative to partition start), in chunks of at
+ * most Pacing::erase_chunk_size. Chunks are aligned so that the flash driver can use block erase.
+ */
+bool OtaHelper::eraseUpTo(const esp_partition_t *partition, size_t end) {
+  if (end > partition->size) {
+    log(ESP_LOG_ERROR, "Data of size " + std::to_string(end) + " does not fit in partition of size " +
+                           std::to_string(partition->size));
+    return false;
+  }
+
+  size_t erase_chunk_size =
+      std::max((size_t)SPI_FLASH_SEC_SIZE, (size_t)_configuration.pacing.erase_chunk_size / SPI_FLASH_SEC_SIZE *
+                                               SPI_FLASH_SEC_SIZE);
+  while (_erased_until < end) {
+    // Erase up to the next chunk boundary, within the partition.
+    size_t address = partition->address + _erased_until;
+    size_t size = erase_chunk_size - (address % erase_chunk_size);
+    size = std::min(size, (size_t)partition->size - _erased_until);
+
+    auto started_us = esp_timer_get_time();
+    esp_err_t r = esp_partition_erase_range(partition, _erased_until, size);
+    onFlashOperationDone(started_us);
+    if (!reportOnError(r, "Failed to erase range")) {
+      return false;
+    }
+    _erased_until += size;
+  }
+  return true;
+}
+
+/**
+ * @brief Account for a flash operation, and yield if continuously busy for longer than allowed.
+ */
+void OtaHelper::onFlashOperationDone(int64_t started_us) {
+  auto elapsed_us = esp_timer_get_time() - started_us;
+  _update_statistics.flash_busy_ms += elapsed_us / 1000;
+  _update_statistics.max_flash_stall_us = std::max(_update_statistics.max_flash_stall_us, (uint32_t)elapsed_us);
+
+  _flash_busy_since_yield_us += elapsed_us;
+  auto max_flash_busy_ms = _configuration.pacing.max_flash_busy_ms;
+  if (max_flash_busy_ms > 0 && _flash_busy_since_yield_us >= (int64_t)max_flash_busy_ms * 1000) {
+    TickType_t ticks = std::max((TickType_t)1, (TickType_t)(_configuration.pacing.flash_yield_ms / portTICK_PERIOD_MS));
+    vTaskDelay(ticks);
+    _update_statistics.throttled_ms += ticks * portTICK_PERIOD_MS;
+    _flash_busy_since_yield_us = 0;
+  }
+}
+
+/**
+ * @brief Delay if writing faster than Pacing::max_bytes_per_second.
+ */
+void OtaHelper::paceStream(int64_t started_us, size_t bytes_written) {
+  auto max_bytes_per_second = _configuration.pacing.max_bytes_per_second;
+  if (max_bytes_per_second == 0) {
+    return;
+  }
+  int64_t expected_us = (int64_t)bytes_written * 1000000 / max_bytes_per_second;
+  int64_t elapsed_us = esp_timer_get_time() - started_us;
+  if (expected_us > elapsed_us) {
+    TickType_t ticks = (expected_us - elapsed_us) / 1000 / portTICK_PERIOD_MS;
+    if (ticks > 0) {
+      vTaskDelay(ticks);
+      _update_statistics.throttled_ms += ticks * portTICK_PERIOD_MS;
+      _flash_busy_since_yield_us = 0;
+    }
+  }
+}
+
+/**
+ * @brief Memory map length bytes from start of partition and call on_window for each mapped window. Mapped in
+ * windows, as the number of free MMU pages is limited. Stops if on_window returns false.
+ */
+bool OtaHelper::forEachMappedWindow(const esp_partition_t *partition, size_t length,
+                                    std::function<bool(const uint8_t *data, size_t length)> on_window) {
+  size_t offset = 0;
+  while (offset < length) {
+    size_t window = std::min(length - offset, (size_t)MMAP_WINDOW_SIZE);
+    const void *data = nullptr;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+    esp_partition_mmap_handle_t handle;
+    auto r = esp_partition_mmap(partition, offset, window, ESP_PARTITION_MMAP_DATA, &data, &handle);
+#else
+    spi_flash_mmap_handle_t handle;
+    auto r = esp_partition_mmap(partition, offset, window, SPI_FLASH_MMAP_DATA, &data, &handle);
+#endif
+    if (!reportOnError(r, "Failed to memory map partition")) {
+      return false;
+    }
+    bool keep_going = on_window((const uint8_t *)data, window);
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+    esp_partition_munmap(handle);
+#else
+    spi_flash_munmap(handle);
+#endif
+    if (!keep_going) {
+      return false;
+    }
+    offset += window;
+    vTaskDelay(0); // Yield/reschedule
+  }
+  return true;
+}
+
+bool OtaHelper::verifyPartitionData(const esp_partition_t *partition, size_t length, const uint8_t *expected_md5,
+                                    size_t expected_md5_length) {
+  ConnectionHelperUtils::MD5Builder md5;
+  md5.begin();
+  if (!forEachMappedWindow(partition, length, [&md5](const uint8_t *data, size_t length) {
+        md5.add(data, length);
+        return true;
+      })) {
+    return false;
+  }
+  md5.calculate();
+
+  if (md5.digestLength() != expected_md5_length ||
+      !ConnectionHelperUtils::constantTimeEquals(md5.digest(), expected_md5, expected_md5_length)) {
+    log(ESP_LOG_ERROR, "Verification of written data failed, flash content does not match received data.");
+    return false;
+  }
+  log(ESP_LOG_INFO, "Verification of written data OK.");
+  return true;
+}
+
+bool OtaHelper::verifyAppImage(const esp_partition_t *partition) {
+  const esp_partition_pos_t position = {
+      .offset = partition->address,
+      .size = partition->size,
+  };
+  esp_image_metadata_t metadata;
+  if (!reportOnError(esp_image_verify(ESP_IMAGE_VERIFY, &position, &metadata), "App image verification failed")) {
+    return false;
+  }
+  log(ESP_LOG_INFO, "App image verification OK.");
+  return true;
+}
+
+/**
+ * @brief Validate the image header, the first segment header and the app description, which are all at the start of
+ * the image, against ImageValidation.
+ */
+bool OtaHelper::validateImageHeader(const uint8_t *data, size_t length) {
+  auto &rules = _configuration.image_validation;
+  size_t header_length = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t);
+  if (length < header_length) {
+    log(ESP_LOG_ERROR, "Start of firmware too short to contain image header: " + std::to_string(length) + " bytes");
+    return false;
+  }
+
+  // Copy out, as the buffer might not be aligned.
+  esp_image_header_t image_header;
+  esp_image_segment_header_t segment_header;
+  esp_app_desc_t app_desc;
+  memcpy(&image_header, data, sizeof(image_header));
+  memcpy(&segment_header, data + sizeof(image_header), sizeof(segment_header));
+  memcpy(&app_desc, data + sizeof(image_header) + sizeof(segment_header), sizeof(app_desc));
+
+  if (image_header.magic != ESP_IMAGE_HEADER_MAGIC) {
+    log(ESP_LOG_ERROR, "Start of firwmare does not contain magic byte");
+    return false;
+  }
+  if (image_header.segment_count == 0 || image_header.segment_count > ESP_IMAGE_MAX_SEGMENTS) {
+    log(ESP_LOG_ERROR, "Invalid segment count in image header: " + std::to_string(image_header.segment_count));
+    return false;
+  }
+  if (rules.check_chip && image_header.chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID) {
+    log(ESP_LOG_ERROR, "Image is built for chip id " + std::to_string(image_header.chip_id) + ", expected " +
+                           std::to_string(CONFIG_IDF_FIRMWARE_CHIP_ID));
+    return false;
+  }
+  if (rules.check_chip_revision) {
+    esp_chip_info_t chip_info;
+    esp_chip_info(&chip_info);
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    uint16_t min_revision = image_header.min_chip_rev_full; // Both in format MXX, M major and XX minor.
+#else
+    uint16_t min_revision = image_header.min_chip_rev;
+#endif
+    if (min_revision > chip_info.revision) {
+      log(ESP_LOG_ERROR, "Image requires chip revision " + std::to_string(min_revision) + ", this chip is revision " +
+                             std::to_string(chip_info.revision));
+      return false;
+    }
+  }
+
+  if (segment_header.data_len < sizeof(esp_app_desc_t) || app_desc.magic_word != ESP_APP_DESC_MAGIC_WORD) {
+    log(ESP_LOG_ERROR, "Image does not contain an app description");
+    return false;
+  }
+
+  auto field = [](const char *value, size_t size) { return std::string(value, strnlen(value, size)); };
+  log(ESP_LOG_INFO, "Image project: " + field(app_desc.project_name, sizeof(app_desc.project_name)) +
+                        ", version: " + field(app_desc.version, sizeof(app_desc.version)) +
+                        ", IDF: " + field(app_desc.idf_ver, sizeof(app_desc.idf_ver)) +
+                        ", secure version: " + std::to_string(app_desc.secure_version));
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  const esp_app_desc_t *running_app = esp_app_get_description();
+#else
+  const esp_app_desc_t *running_app = esp_ota_get_app_description();
+#endif
+  if (rules.require_same_project &&
+      strncmp(app_desc.project_name, running_app->project_name, sizeof(app_desc.project_name)) != 0) {
+    log(ESP_LOG_ERROR, "Image is for another project, running project is " +
+                           field(running_app->project_name, sizeof(running_app->project_name)));
+    return false;
+  }
+  if (rules.reject_same_version && strncmp(app_desc.version, running_app->version, sizeof(app_desc.version)) == 0) {
+    log(ESP_LOG_ERROR, "Image has the same version as the running firmware");
+    return false;
+  }
+#ifdef CONFIG_BOOTLOADER_APP_ANTI_ROLLBACK
+  if (rules.check_secure_version && !esp_efuse_check_secure_version(app_desc.secure_version)) {
+    log(ESP_LOG_ERROR, "Image secure version " + std::to_string(app_desc.secure_version) + " is lower than allowed");
+    return false;
+  }
+#endif
+  if (rules.accept_app && !rules.accept_app(app_desc, *running_app)) {
+    log(ESP_LOG_ERROR, "Image rejected by accept_app rule");
+    return false;
+  }
+  return true;
+}
+
+esp_err_t OtaHelper::partitionIsBootable(const esp_partition_t *partition) {
+  uint8_t buf[ENCRYPTED_BLOCK_SIZE];
+  if (!partition) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  esp_err_t r = esp_partition_read(partition, 0, (uint32_t *)buf, ENCRYPTED_BLOCK_SIZE);
+  if (r != ESP_OK) {
+    return r;
+  }
+
+  if (buf[0] != ESP_IMAGE_HEADER_MAGIC) {
+    return ESP_ERR_INVALID_CRC;
+  }
+  return ESP_OK;
+}
+
+bool OtaHelper::checkDataInBlock(const uint8_t *data, size_t len) {
+  // check 32-bit aligned blocks only
+  if (!len || len % sizeof(uint32_t))
+    return true;
+
+  size_t dwl = len / sizeof(uint32_t);
+
+  do {
+    if (*(uint32_t *)data ^ 0xffffffff) // for SPI NOR flash empty blocks are all one's, i.e. filled with 0xff byte
+      return true;
+
+    data += sizeof(uint32_t);
+  } while (--dwl);
+  return false;
+}
+
+const esp_partition_t *OtaHelper::findPartition(FlashMode flash_mode) {
+
+  if (flash_mode == FlashMode::FIRMWARE) {
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    if (partition == nullptr) {
+      log(ESP_LOG_ERROR, "No firmware OTA partition found");
+    }
+    return partition;
+  } else if (flash_mode == FlashMode::SPIFFS) {
+    const esp_partition_t *partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+    if (partition == nullptr) {
+      log(ESP_LOG_ERROR, "No SPIIFS partition found");
+    }
+    return partition;
+  }
+  return nullptr;
+}
+
+void OtaHelper::enterUpdatePowerMode() {
+  if (_configuration.power_management.disable_wifi_power_save) {
+    wifi_ps_type_t current_ps;
+    // Fails if WiFi is not initialized (e.g. running on ethernet), in which case there is nothing to do.
+    if (esp_wifi_get_ps(&current_ps) == ESP_OK && current_ps != WIFI_PS_NONE) {
+      if (reportOnError(esp_wifi_set_ps(WIFI_PS_NONE), "Failed to disable WiFi power save")) {
+        log(ESP_LOG_INFO, "WiFi power save disabled during update");
+        _wifi_ps_to_restore = current_ps;
+      }
+    }
+  }
+
+  if (_configuration.power_management.lock_cpu_frequency) {
+    if (_pm_lock == nullptr) {
+      auto r = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "ota", &_pm_lock);
+      if (r == ESP_ERR_NOT_SUPPORTED) {
+        log(ESP_LOG_WARN, "Unable to lock CPU frequency, CONFIG_PM_ENABLE is not enabled in sdkconfig.");
+        _pm_lock = nullptr;
+      } else if (!reportOnError(r, "Failed to create PM lock")) {
+        _pm_lock = nullptr;
+      }
+    }
+    if (_pm_lock != nullptr) {
+      reportOnError(esp_pm_lock_acquire(_pm_lock), "Failed to acquire PM lock");
+    }
+  }
+}
+
+void OtaHelper::exitUpdatePowerMode() {
+  if (_wifi_ps_to_restore) {
+    if (reportOnError(esp_wifi_set_ps(*_wifi_ps_to_restore), "Failed to restore WiFi power save")) {
+      log(ESP_LOG_INFO, "WiFi power save restored");
+    }
+    _wifi_ps_to_restore = std::nullopt;
+  }
+
+  if (_configuration.power_management.lock_cpu_frequency && _pm_lock != nullptr) {
+    reportOnError(esp_pm_lock_release(_pm_lock), "Failed to release PM lock");
+  }
+}
+
+// #########################################################################
+// On demand activation
+// #########################################################################
+
+bool OtaHelper::activate() {
+  if (!_configuration.on_demand.enabled) {
+    return _active;
+  }
+
+  bool success = true;
+  xSemaphoreTake(_activation_mutex, portMAX_DELAY);
+  if (!_active) {
+    // Let a previous ArduinoOTA task finish closing its socket before binding the port again.
+    while (_arduino_ota_running) {
+      vTaskDelay(pdMS_TO_TICKS(10));
+    }
+
+    size_t free_heap_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (_configuration.arduino_ota.enabled && _configuration.reactor.enabled) {
+      _arduino_ota_stop = false; // The reactor task opens the socket.
+    } else if (_configuration.arduino_ota.enabled) {
+      _arduino_ota_stop = false;
+      // Set before creating, as the task may preempt this one and clear it again if it fails to bind.
+      _arduino_ota_running = true;
+      if (!createTask(arduinoOtaUdpServerTask, "arduino_udp", _configuration.arduino_ota.task_stack_size,
+                      _configuration.arduino_ota.task_priority, _configuration.arduino_ota.task_core_id,
+                      _arduino_ota_task_storage)) {
+        _arduino_ota_running = false;
+        success = false;
+      }
+    }
+    if (_configuration.web_ota.enabled) {
+      success = startWebserver() && success;
+    }
+    // Set active even on partial failure, so that deactivate() cleans up whatever got started.
+    _active = true;
+    size_t free_heap_after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    _active_heap_usage = free_heap_before > free_heap_after ? free_heap_before - free_heap_after : 0;
+    log(ESP_LOG_INFO, "OTA services activated, using ~" + std::to_string(_active_heap_usage) + " bytes heap");
+  }
+  onActivity();
+  xSemaphoreGive(_activation_mutex);
+  return success;
+}
 
-    data += sizeof(uint32_t);
-  } while (--dwl);
-  return false;
+void OtaHelper::deactivate() {
+  if (!_configuration.on_demand.enabled) {
+    return;
+  }
+
+  xSemaphoreTake(_activation_mutex, portMAX_DELAY);
+  if (_active) {
+    if (_update_in_progress) {
+      log(ESP_LOG_INFO, "Not deactivating OTA services, update in progress");
+      onActivity();
+    } else {
+      if (_httpd_handle != nullptr) {
+        reportOnError(httpd_stop(_httpd_handle), "failed to stop httpd");
+        _httpd_handle = nullptr;
+        xEventGroupClearBits(_rollback_event_group, WEB_OTA_STARTED_BIT);
+      }
+      // The ArduinoOTA task exits on its own within ARDUINO_OTA_RECV_TIMEOUT_MS, or the reactor closes the socket.
+      _arduino_ota_stop = true;
+      _active = false;
+      log(ESP_LOG_INFO, "OTA services deactivated");
+    }
+  }
+  xSemaphoreGive(_activation_mutex);
 }
 
-const esp_partition_t *OtaHelper::findPartition(FlashMode flash_mode) {
+void OtaHelper::onActivity() {
+  if (_idle_timer != nullptr && _active) {
+    esp_timer_stop(_idle_timer); // Fails if not running, which is fine.
+    reportOnError(esp_timer_start_once(_idle_timer, (uint64_t)_configuration.on_demand.idle_timeout_ms * 1000),
+                  "failed to start idle timer");
+  }
+}
 
-  if (flash_mode == FlashMode::FIRMWARE) {
-    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
-    if (partition == nullptr) {
-      log(ESP_LOG_ERROR, "No firmware OTA partition found");
+void OtaHelper::idleTimerCallback(void *arg) {
+  OtaHelper *_this = (OtaHelper *)arg;
+  // Only signal, as deactivate() waits for the activation mutex and for httpd to stop, which would stall all other
+  // esp_timer callbacks. The wake listener or reactor task picks it up within a second.
+  _this->_deactivate_requested = true;
+  auto &config = _this->_configuration;
+  if (!config.reactor.enabled && config.on_demand.wake_udp_port == 0) {
+    // No listener task, so deactivate from a short lived one.
+    TaskStorage storage;
+    _this->createTask(deactivateTask, "ota_deactivate", config.on_demand.wake_task_stack_size,
+                      config.on_demand.wake_task_priority, config.on_demand.wake_task_core_id, storage);
+  }
+}
+
+void OtaHelper::deactivateTask(void *pvParameters) {
+  OtaHelper *_this = (OtaHelper *)pvParameters;
+  _this->handleDeactivateRequest();
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Deactivate if requested by the idle timer. Called from the wake listener, reactor or deactivate task.
+ */
+void OtaHelper::handleDeactivateRequest() {
+  if (_deactivate_requested.exchange(false)) {
+    log(ESP_LOG_INFO, "OTA services idle for " + std::to_string(_configuration.on_demand.idle_timeout_ms) + "ms");
+    deactivate();
+  }
+}
+
+void OtaHelper::wakeListenerTask(void *pvParameters) {
+  OtaHelper *_this = (OtaHelper *)pvParameters;
+
+  while (1) {
+    int sock = _this->openWakeSocket(WAKE_RECV_TIMEOUT_MS);
+    if (sock < 0) {
+      _this->notifyReady(false);
+      break;
     }
-    return partition;
-  } else if (flash_mode == FlashMode::SPIFFS) {
-    const esp_partition_t *partition =
-        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
-    if (partition == nullptr) {
-      log(ESP_LOG_ERROR, "No SPIIFS partition found");
+    while (_this->handleWakePacket(sock)) {
+      _this->handleDeactivateRequest();
+    }
+    _this->log(ESP_LOG_ERROR, "Shutting down wake UDP and restarting socket...");
+    shutdown(sock, 0);
+    close(sock);
+  }
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Create and bind the wake UDP socket.
+ *
+ * @param recv_timeout_ms receive timeout, 0 to block.
+ * @return the socket, or -1 on failure.
+ */
+int OtaHelper::openWakeSocket(uint32_t recv_timeout_ms) {
+  auto port = _configuration.on_demand.wake_udp_port;
+  struct sockaddr_in dest_addr_ip4;
+  dest_addr_ip4.sin_addr.s_addr = htonl(INADDR_ANY);
+  dest_addr_ip4.sin_family = AF_INET;
+  dest_addr_ip4.sin_port = htons(port);
+
+  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (sock < 0) {
+    log(ESP_LOG_ERROR, "Unable to create wake UDP socket: errno " + std::to_string(errno));
+    return -1;
+  }
+
+  int err = bind(sock, (struct sockaddr *)&dest_addr_ip4, sizeof(dest_addr_ip4));
+  if (err < 0) {
+    log(ESP_LOG_ERROR, "Wake UDP socket unable to bind: errno " + std::to_string(errno));
+    close(sock);
+    return -1;
+  }
+  if (recv_timeout_ms > 0) {
+    // Wake up regularly to deactivate when idle.
+    struct timeval timeout = {.tv_sec = (time_t)(recv_timeout_ms / 1000),
+                              .tv_usec = (suseconds_t)(recv_timeout_ms % 1000 * 1000)};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+  log(ESP_LOG_INFO, "Wake UDP socket bound, port " + std::to_string(port));
+  onServiceStarted(WAKE_LISTENER_STARTED_BIT);
+  return sock;
+}
+
+/**
+ * @brief Receive and handle one packet on the wake UDP socket.
+ *
+ * @return false if the socket should be recreated.
+ */
+bool OtaHelper::handleWakePacket(int sock) {
+  char rx_buffer[16];
+  struct sockaddr_storage source_addr;
+  socklen_t socklen = sizeof(source_addr);
+  int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr *)&source_addr, &socklen);
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true; // Receive timeout.
+  }
+  if (len < 0) {
+    log(ESP_LOG_ERROR, "Wake UDP recvfrom failed: errno " + std::to_string(errno));
+    return false;
+  }
+  rx_buffer[len] = 0;
+  if (strncmp(rx_buffer, WAKE_PACKET, strlen(WAKE_PACKET)) != 0) {
+    log(ESP_LOG_WARN, "Ignoring unknown packet on wake UDP socket");
+    return true;
+  }
+
+  log(ESP_LOG_INFO, "Got wake packet, activating OTA services");
+  const char *reply = activate() ? WAKE_REPLY_OK : WAKE_REPLY_FAILED;
+  sendto(sock, reply, strlen(reply), 0, (struct sockaddr *)&source_addr, socklen);
+  return true;
+}
+
+// #########################################################################
+// Reactor
+// #########################################################################
+
+void OtaHelper::reactorTask(void *pvParameters) {
+  OtaHelper *_this = (OtaHelper *)pvParameters;
+  auto &config = _this->_configuration;
+
+  int arduino_sock = -1;
+  int wake_sock = -1;
+  int multicast_sock = -1;
+  // Do not retry a listener that failed to open, as the dedicated tasks do not either.
+  bool arduino_failed = false;
+  bool wake_failed = false;
+  bool multicast_failed = false;
+  ArduinoOtaState arduino_state;
+  MulticastState multicast_state;
+
+  while (1) {
+    _this->handleDeactivateRequest();
+    // ArduinoOTA is opened and closed here on (de)activation, instead of starting and stopping its task.
+    bool arduino_wanted = config.arduino_ota.enabled && !_this->_arduino_ota_stop &&
+                          (!config.on_demand.enabled || _this->_active);
+    if (arduino_wanted && arduino_sock < 0 && !arduino_failed) {
+      arduino_sock = _this->openArduinoOtaSocket(0);
+      arduino_failed = arduino_sock < 0;
+      if (arduino_sock < 0) {
+        _this->notifyReady(false);
+      }
+      arduino_state = {};
+    } else if (!arduino_wanted) {
+      if (arduino_sock >= 0) {
+        _this->closeArduinoOtaSocket(arduino_sock);
+        arduino_sock = -1;
+      }
+      arduino_failed = false;
+    }
+    if (config.on_demand.enabled && config.on_demand.wake_udp_port != 0 && wake_sock < 0 && !wake_failed) {
+      wake_sock = _this->openWakeSocket(0);
+      wake_failed = wake_sock < 0;
+      if (wake_sock < 0) {
+        _this->notifyReady(false);
+      }
+    }
+    if (config.multicast_ota.enabled && multicast_sock < 0 && !multicast_failed) {
+      multicast_sock = _this->openMulticastSocket(0);
+      multicast_failed = multicast_sock < 0;
+      if (multicast_sock < 0) {
+        _this->notifyReady(false);
+      }
+    }
+
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    int max_fd = -1;
+    for (int sock : {arduino_sock, wake_sock, multicast_sock}) {
+      if (sock >= 0) {
+        FD_SET(sock, &read_fds);
+        max_fd = std::max(max_fd, sock);
+      }
+    }
+    if (max_fd < 0) {
+      // Nothing to listen on, e.g. on demand without wake port before activation.
+      vTaskDelay(pdMS_TO_TICKS(REACTOR_TICK_MS));
+      continue;
+    }
+
+    struct timeval timeout = {.tv_sec = 0, .tv_usec = REACTOR_TICK_MS * 1000};
+    int ready = select(max_fd + 1, &read_fds, nullptr, nullptr, &timeout);
+    if (ready < 0 && errno != EINTR) {
+      _this->log(ESP_LOG_ERROR, "Reactor select failed: errno " + std::to_string(errno));
+      vTaskDelay(pdMS_TO_TICKS(REACTOR_TICK_MS));
+      continue;
+    }
+
+    if (ready > 0 && arduino_sock >= 0 && FD_ISSET(arduino_sock, &read_fds) &&
+        !_this->handleArduinoOtaPacket(arduino_sock, arduino_state)) {
+      _this->closeArduinoOtaSocket(arduino_sock);
+      arduino_sock = -1;
+    }
+    if (ready > 0 && wake_sock >= 0 && FD_ISSET(wake_sock, &read_fds) && !_this->handleWakePacket(wake_sock)) {
+      _this->log(ESP_LOG_ERROR, "Shutting down wake UDP and restarting socket...");
+      shutdown(wake_sock, 0);
+      close(wake_sock);
+      wake_sock = -1;
+    }
+    if (ready > 0 && multicast_sock >= 0 && FD_ISSET(multicast_sock, &read_fds) &&
+        !_this->handleMulticastPacket(multicast_sock, multicast_state)) {
+      _this->log(ESP_LOG_ERROR, "Shutting down multicast UDP and restarting socket...");
+      shutdown(multicast_sock, 0);
+      close(multicast_sock);
+      multicast_sock = -1;
+    }
+    // Also on timeout, to request missing blocks and to time out the session.
+    if (multicast_sock >= 0) {
+      _this->serviceMulticastSession(multicast_sock, multicast_state);
     }
-    return partition;
   }
-  return nullptr;
 }
 
 // #########################################################################
@@ -978,23 +3328,480 @@ const esp_partition_t *OtaHelper::findPartition(FlashMode flash_mode) {
 void OtaHelper::rollbackWatcherTask(void *pvParameters) {
   OtaHelper *_this = (OtaHelper *)pvParameters;
 
-  // Wait for rollback_timeout_ms until confirming.
-  vTaskDelay(_this->_configuration.rollback_timeout_ms / portTICK_PERIOD_MS);
+  if (_this->_health_probe_count > 0) {
+    _this->watchHealthProbes();
+  } else {
+    // Wait for rollback_timeout_ms until confirming.
+    vTaskDelay(_this->_configuration.rollback_timeout_ms / portTICK_PERIOD_MS);
+
+    auto wait_bits = _this->_rollback_bits_to_wait_for;
+    if (wait_bits > 0) {
+      xEventGroupWaitBits(_this->_rollback_event_group, wait_bits, pdFALSE, pdFALSE, portMAX_DELAY);
+    }
+    // We got all bits, or no bits to wait for. Canceling rollback.
+    _this->cancelRollback();
+  }
+
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Confirm the running firmware as soon as all OTA services are up and all health probes have passed, or roll
+ * back as soon as a probe fails or misses its deadline. Re-evaluated on each started/passed/failed event, and at the
+ * next pending deadline.
+ */
+void OtaHelper::watchHealthProbes() {
+  EventBits_t probe_bits = 0;
+  for (uint8_t i = 0; i < _health_probe_count; ++i) {
+    probe_bits |= HEALTH_PROBE_BIT(i);
+  }
+  EventBits_t wait_bits = _rollback_bits_to_wait_for | probe_bits;
+
+  esp_ota_img_states_t running_state;
+  bool pending_verify = esp_ota_get_state_partition(esp_ota_get_running_partition(), &running_state) == ESP_OK &&
+                        running_state == ESP_OTA_IMG_PENDING_VERIFY;
+
+  while (1) {
+    auto bits = xEventGroupGetBits(_rollback_event_group);
+    if (bits & HEALTH_PROBE_FAILED_BIT) {
+      std::string failed;
+      for (uint8_t i = 0; i < _health_probe_count; ++i) {
+        if (_health_probes[i].failed) {
+          failed += (failed.empty() ? "" : ", ") + _health_probes[i].name;
+        }
+      }
+      onHealthProbeFailed("Health probe " + failed + " failed", pending_verify);
+      return;
+    }
+
+    auto now = esp_timer_get_time();
+    int64_t next_deadline_us = INT64_MAX;
+    for (uint8_t i = 0; i < _health_probe_count; ++i) {
+      auto &probe = _health_probes[i];
+      if (bits & HEALTH_PROBE_BIT(i)) {
+        continue;
+      }
+      int64_t deadline_us = _startup_timings.start_called_us + (int64_t)probe.deadline_ms * 1000;
+      if (now >= deadline_us) {
+        onHealthProbeFailed("Health probe " + probe.name + " did not pass within " +
+                                std::to_string(probe.deadline_ms) + "ms",
+                            pending_verify);
+        return;
+      }
+      next_deadline_us = std::min(next_deadline_us, deadline_us);
+    }
+
+    if ((bits & probe_bits) == probe_bits && _startup_timings.health_probes_passed_us == 0) {
+      int64_t passed_us = 0;
+      for (uint8_t i = 0; i < _health_probe_count; ++i) {
+        passed_us = std::max(passed_us, (int64_t)_health_probes[i].passed_us);
+      }
+      setStartupTiming(&StartupTimings::health_probes_passed_us, passed_us);
+      log(ESP_LOG_INFO, "All " + std::to_string(_health_probe_count) + " health probes passed, " +
+                            std::to_string((passed_us - _startup_timings.start_called_us) / 1000) +
+                            "ms after start");
+    }
+    if ((bits & wait_bits) == wait_bits) {
+      cancelRollback();
+      return;
+    }
+
+    // Wake up on any bit not yet set, or at the next deadline.
+    TickType_t timeout = next_deadline_us == INT64_MAX ? portMAX_DELAY
+                                                       : pdMS_TO_TICKS((next_deadline_us - now + 999) / 1000);
+    xEventGroupWaitBits(_rollback_event_group, (wait_bits & ~bits) | HEALTH_PROBE_FAILED_BIT, pdFALSE, pdFALSE,
+                        timeout);
+  }
+}
+
+void OtaHelper::onHealthProbeFailed(const std::string &reason, bool pending_verify) {
+  if (!pending_verify) {
+    log(ESP_LOG_WARN, reason + ", not rolling back as the running firmware is already confirmed");
+    return;
+  }
+  log(ESP_LOG_ERROR, reason + ", rolling back to the previous firmware");
+  // Reboots on success.
+  reportOnError(esp_ota_mark_app_invalid_rollback_and_reboot(), "Failed to roll back");
+}
+
+// #########################################################################
+// Pre-erase
+// #########################################################################
+
+void OtaHelper::startPreErase() {
+  if (!_configuration.pre_erase.enabled || _pre_erase_started.exchange(true)) {
+    return;
+  }
+  createTask(preEraseTask, "ota_pre_erase", _configuration.pre_erase.task_stack_size,
+             _configuration.pre_erase.task_priority, _configuration.pre_erase.task_core_id, _pre_erase_task_storage);
+}
+
+/**
+ * @brief Stop pre-erasing for good, waiting for an ongoing step to complete. Called when an update session starts.
+ */
+void OtaHelper::stopPreErase() {
+  if (_pre_erase_started) {
+    _pre_erase_stop = true;
+    xSemaphoreTake(_pre_erase_mutex, portMAX_DELAY);
+    xSemaphoreGive(_pre_erase_mutex);
+  }
+}
+
+void OtaHelper::preEraseTask(void *pvParameters) {
+  OtaHelper *_this = (OtaHelper *)pvParameters;
+  auto &config = _this->_configuration.pre_erase;
+
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+  if (partition == nullptr) {
+    _this->log(ESP_LOG_WARN, "No update partition to pre-erase");
+    vTaskDelete(NULL);
+    return;
+  }
 
-  auto wait_bits = _this->_rollback_bits_to_wait_for;
-  if (wait_bits > 0) {
-    xEventGroupWaitBits(_this->_rollback_event_group, wait_bits, pdFALSE, pdFALSE, portMAX_DELAY);
+  size_t erased = _this->loadPreErased(partition);
+  if (erased >= partition->size) {
+    _this->log(ESP_LOG_INFO, "Partition " + std::string(partition->label) + " already pre-erased");
+    vTaskDelete(NULL);
+    return;
+  }
+  _this->log(ESP_LOG_INFO, "Pre-erasing partition " + std::string(partition->label) + " from offset " +
+                               std::to_string(erased));
+
+  size_t step_size = std::max((size_t)SPI_FLASH_SEC_SIZE, (size_t)config.step_size / SPI_FLASH_SEC_SIZE *
+                                                              SPI_FLASH_SEC_SIZE);
+  TickType_t step_delay = std::max((TickType_t)1, (TickType_t)pdMS_TO_TICKS(config.step_delay_ms));
+  size_t persisted = erased;
+  auto started_us = esp_timer_get_time();
+  while (erased < partition->size) {
+    xSemaphoreTake(_this->_pre_erase_mutex, portMAX_DELAY);
+    if (_this->_pre_erase_stop) {
+      xSemaphoreGive(_this->_pre_erase_mutex);
+      break;
+    }
+    size_t size = std::min(step_size, (size_t)partition->size - erased);
+    auto r = esp_partition_erase_range(partition, erased, size);
+    if (r == ESP_OK) {
+      erased += size;
+      // Persist now and then rather than on each step, to limit NVS writes. Within the mutex, so that a starting update
+      // never sees a marker for data it is about to write.
+      if (erased - persisted >= PRE_ERASE_PERSIST_INTERVAL || erased == partition->size) {
+        _this->storePreErased(partition, erased);
+        persisted = erased;
+      }
+    }
+    xSemaphoreGive(_this->_pre_erase_mutex);
+    if (!_this->reportOnError(r, "Failed to pre-erase range")) {
+      break;
+    }
+    vTaskDelay(step_delay);
   }
-  // We got all bits, or no bits to wait for. Canceling rollback.
-  _this->cancelRollback();
 
+  if (erased == partition->size) {
+    _this->log(ESP_LOG_INFO, "Pre-erased partition " + std::string(partition->label) + " in " +
+                                 std::to_string((esp_timer_get_time() - started_us) / 1000) + "ms");
+  } else {
+    _this->log(ESP_LOG_INFO, "Pre-erase stopped at offset " + std::to_string(erased));
+  }
   vTaskDelete(NULL);
 }
 
+/**
+ * @brief Return how much of the start of the partition is known to be erased, and clear the marker as the partition is
+ * about to be written.
+ */
+size_t OtaHelper::claimPreErased(const esp_partition_t *partition) {
+  size_t erased = loadPreErased(partition);
+  if (erased == 0) {
+    return 0;
+  }
+  storePreErased(partition, 0);
+
+  // Guard against a stale marker, e.g. after flashing over serial. Reading is much faster than erasing. Not possible on
+  // encrypted partitions, as erased flash does not read as 0xFF.
+  if (!partition->encrypted &&
+      !forEachMappedWindow(partition, erased,
+                           [this](const uint8_t *data, size_t length) { return !checkDataInBlock(data, length); })) {
+    log(ESP_LOG_WARN, "Partition " + std::string(partition->label) + " not erased as expected, erasing");
+    return 0;
+  }
+  log(ESP_LOG_INFO, "Skipping erase of " + std::to_string(erased) + " pre-erased bytes");
+  return erased;
+}
+
+size_t OtaHelper::loadPreErased(const esp_partition_t *partition) {
+  nvs_handle_t handle;
+  if (nvs_open(PRE_ERASE_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return 0; // Nothing stored yet.
+  }
+  uint32_t address = 0;
+  uint32_t length = 0;
+  bool found = nvs_get_u32(handle, PRE_ERASE_NVS_ADDRESS_KEY, &address) == ESP_OK &&
+               nvs_get_u32(handle, PRE_ERASE_NVS_LENGTH_KEY, &length) == ESP_OK;
+  nvs_close(handle);
+  if (!found || address != partition->address) {
+    return 0;
+  }
+  return std::min((size_t)length, (size_t)partition->size);
+}
+
+void OtaHelper::storePreErased(const esp_partition_t *partition, size_t erased) {
+  nvs_handle_t handle;
+  if (!reportOnError(nvs_open(PRE_ERASE_NVS_NAMESPACE, NVS_READWRITE, &handle), "Failed to open NVS")) {
+    return;
+  }
+  esp_err_t r;
+  if (erased == 0) {
+    r = nvs_erase_key(handle, PRE_ERASE_NVS_LENGTH_KEY);
+    r = r == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : r;
+  } else {
+    r = nvs_set_u32(handle, PRE_ERASE_NVS_ADDRESS_KEY, partition->address);
+    if (r == ESP_OK) {
+      r = nvs_set_u32(handle, PRE_ERASE_NVS_LENGTH_KEY, erased);
+    }
+  }
+  if (r == ESP_OK) {
+    r = nvs_commit(handle);
+  }
+  reportOnError(r, "Failed to store pre-erase progress");
+  nvs_close(handle);
+}
+
+// #########################################################################
+// Update sessions
+// #########################################################################
+
+/**
+ * @brief Start an update session, so that only one update is in progress at a time regardless of source.
+ *
+ * @param ticks_to_wait time to wait for an ongoing update to complete, 0 to fail right away.
+ * @return true if the session was started, in which case endSession() must be called, from any task.
+ */
+bool OtaHelper::beginSession(UpdateSource source, TickType_t ticks_to_wait) {
+  if (ticks_to_wait > 0 && isUpdateInProgress()) {
+    log(ESP_LOG_INFO, "Update via " + sourceToString(_session_source) + " in progress, waiting for it to complete");
+  }
+  if (xSemaphoreTake(_session_semaphore, ticks_to_wait) != pdTRUE) {
+    log(ESP_LOG_WARN, "Rejecting update via " + sourceToString(source) + ", update via " +
+                          sourceToString(_session_source) + " already in progress");
+    return false;
+  }
+  _session_id++;
+  _session_source = source;
+  stopPreErase();
+  log(ESP_LOG_INFO, "Session " + std::to_string(_session_id) + " started via " + sourceToString(source));
+  return true;
+}
+
+void OtaHelper::endSession(bool success) {
+  log(ESP_LOG_INFO, "Session " + std::to_string(_session_id) + (success ? " completed" : " failed"));
+  _session_source = UpdateSource::NONE;
+  xSemaphoreGive(_session_semaphore);
+}
+
+std::string OtaHelper::sourceToString(UpdateSource source) {
+  switch (source) {
+  case UpdateSource::WEB_OTA:
+    return "web OTA";
+  case UpdateSource::ARDUINO_OTA:
+    return "ArduinoOTA";
+  case UpdateSource::REMOTE_HTTP:
+    return "remote HTTP";
+  case UpdateSource::SINK:
+    return "sink";
+  case UpdateSource::MULTICAST:
+    return "multicast";
+  default:
+    return "none";
+  }
+}
+
 // #########################################################################
 // Generic utils
 // #########################################################################
 
+bool OtaHelper::reserveTaskStorage(TaskStorage &storage, uint32_t stack_size) {
+  // Task stack and TCB must be in internal RAM. Stack size is in bytes in ESP-IDF.
+  storage.stack = (StackType_t *)heap_caps_malloc(stack_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  storage.tcb = (StaticTask_t *)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (storage.stack == nullptr || storage.tcb == nullptr) {
+    log(ESP_LOG_ERROR, "Failed to reserve task stack of size " + std::to_string(stack_size));
+    heap_caps_free(storage.stack);
+    heap_caps_free(storage.tcb);
+    storage = {};
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Create task, using storage if reserved (see reserveTaskStorage()). The task gets parameters, or this if
+ * nullptr.
+ */
+bool OtaHelper::createTask(TaskFunction_t task, const char *name, uint32_t stack_size, UBaseType_t priority,
+                           BaseType_t core_id, TaskStorage &storage, void *parameters) {
+  if (parameters == nullptr) {
+    parameters = this;
+  }
+  if (storage.stack != nullptr && storage.tcb != nullptr) {
+    if (xTaskCreateStaticPinnedToCore(task, name, stack_size, parameters, priority, storage.stack, storage.tcb,
+                                      core_id) == nullptr) {
+      log(ESP_LOG_ERROR, "Failed to create task " + std::string(name));
+      return false;
+    }
+  } else if (xTaskCreatePinnedToCore(task, name, stack_size, parameters, priority, NULL, core_id) != pdPASS) {
+    log(ESP_LOG_ERROR, "Failed to create task " + std::string(name));
+    return false;
+  }
+  return true;
+}
+
+char *OtaHelper::acquireUpdateBuffer() {
+  // Fall back to the heap if the reserved buffer is already used by a concurrent update.
+  bool in_use = false;
+  if (_update_buffer != nullptr && _update_buffer_in_use.compare_exchange_strong(in_use, true)) {
+    return _update_buffer;
+  }
+  return (char *)malloc(_chunk_size);
+}
+
+void OtaHelper::releaseUpdateBuffer(char *buffer) {
+  if (buffer == _update_buffer) {
+    _update_buffer_in_use = false;
+  } else {
+    free(buffer);
+  }
+}
+
+bool OtaHelper::isLogEnabled(const esp_log_level_t log_level) {
+  if (!_on_log.empty()) {
+    return true;
+  }
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  return esp_log_level_get(OtaHelperLog::TAG) >= log_level;
+#else
+  return true;
+#endif
+}
+
+void OtaHelper::logConfiguration() {
+  if (!isLogEnabled(ESP_LOG_INFO)) {
+    return;
+  }
+  auto &c = _configuration;
+  std::string line = "Starting OtaHelper: rollback ";
+  if (c.rollback_strategy == RollbackStrategy::MANUAL) {
+    line += "manual";
+  } else if (_health_probe_count > 0) {
+    line += "auto (probes";
+    for (uint8_t i = 0; i < _health_probe_count; ++i) {
+      line += " " + _health_probes[i].name + "<" + std::to_string(_health_probes[i].deadline_ms) + "ms";
+    }
+    line += ")";
+  } else {
+    line += "auto (" + std::to_string(c.rollback_timeout_ms) + "ms)";
+  }
+  if (c.web_ota.enabled) {
+    line += ", web :" + std::to_string(c.web_ota.http_port);
+    line += c.web_ota.id.empty() ? "" : " id " + c.web_ota.id;
+    if (!c.web_ota.credentials.username.empty()) {
+      line += " user " + c.web_ota.credentials.username + (c.web_ota.digest_auth ? " (digest)" : " (basic)");
+    }
+    line += c.web_ota.serve_firmware ? " serving " FIRMWARE_URI : "";
+  }
+  if (c.arduino_ota.enabled) {
+    line += ", espota :" + std::to_string(c.arduino_ota.udp_listenting_port) +
+            (c.arduino_ota.password.empty() ? "" : " (auth)");
+  }
+  if (c.multicast_ota.enabled) {
+    line += ", multicast " + c.multicast_ota.group + ":" + std::to_string(c.multicast_ota.port) +
+            (c.multicast_ota.password.empty() ? "" : " (auth)");
+  }
+  if (c.on_demand.enabled) {
+    auto wake_port = c.on_demand.wake_udp_port;
+    line += ", on demand (wake " + (wake_port != 0 ? ":" + std::to_string(wake_port) : std::string("none")) +
+            ", idle " + std::to_string(c.on_demand.idle_timeout_ms) + "ms)";
+  }
+  line += c.reactor.enabled ? ", reactor" : "";
+  line += ", chunk " + std::to_string(_chunk_size);
+  log(ESP_LOG_INFO, line);
+
+  if (isLogEnabled(ESP_LOG_DEBUG)) {
+    auto task = [this](const char *name, UBaseType_t priority, uint32_t stack_size, BaseType_t core_id) {
+      return std::string(name) + " " + std::to_string(priority) + "/" + std::to_string(stack_size) + "/" +
+             coreToString(core_id);
+    };
+    std::string tasks = "Tasks (priority/stack/core): ";
+    tasks += task("httpd", c.web_ota.task_priority, c.web_ota.task_stack_size, c.web_ota.task_core_id);
+    tasks += ", " +
+             task("espota", c.arduino_ota.task_priority, c.arduino_ota.task_stack_size, c.arduino_ota.task_core_id);
+    tasks += ", " + task("rollback", c.rollback_task_priority, c.rollback_task_stack_size, c.rollback_task_core_id);
+    log(ESP_LOG_DEBUG, tasks);
+  }
+}
+
+void OtaHelper::onServiceStarted(EventBits_t bit) {
+  auto bits = xEventGroupSetBits(_rollback_event_group, bit);
+  if ((bits & _rollback_bits_to_wait_for) == _rollback_bits_to_wait_for) {
+    notifyReady(true);
+  }
+}
+
+void OtaHelper::notifyReady(bool ready) {
+  if (_ready_notified.exchange(true)) {
+    return;
+  }
+  if (ready) {
+    setStartupTiming(&StartupTimings::ready_us, esp_timer_get_time());
+  } else {
+    log(ESP_LOG_ERROR, "Not all OTA services could be started");
+  }
+  if (_ready_callback) {
+    _ready_callback(ready);
+  }
+}
+
+/**
+ * @brief Set a startup timing, unless already set.
+ *
+ * @return true if set.
+ */
+bool OtaHelper::setStartupTiming(int64_t StartupTimings::*field, int64_t us) {
+  portENTER_CRITICAL(&_startup_timings_lock);
+  bool first = _startup_timings.*field == 0;
+  if (first) {
+    _startup_timings.*field = us;
+  }
+  portEXIT_CRITICAL(&_startup_timings_lock);
+  return first;
+}
+
+OtaHelper::StartupTimings OtaHelper::getStartupTimings() {
+  portENTER_CRITICAL(&_startup_timings_lock);
+  StartupTimings timings = _startup_timings;
+  portEXIT_CRITICAL(&_startup_timings_lock);
+  return timings;
+}
+
+void OtaHelper::onStartupPhaseCompleted() {
+  auto t = getStartupTimings(); // Snapshot, as set from several tasks.
+  bool on_demand = _configuration.on_demand.enabled;
+  bool complete = t.start_returned_us > 0 && (on_demand || !_configuration.web_ota.enabled || t.httpd_started_us > 0) &&
+                  (on_demand || !_configuration.arduino_ota.enabled || t.udp_bound_us > 0) &&
+                  (!_rollback_watcher_started || t.rollback_confirmed_us > 0);
+  if (!complete || _startup_timings_logged.exchange(true)) {
+    return;
+  }
+
+  auto since_start = [&t](int64_t us) {
+    return us > 0 ? std::to_string((us - t.start_called_us) / 1000) + "ms" : std::string("-");
+  };
+  log(ESP_LOG_INFO, "Started at " + std::to_string(t.start_called_us / 1000) +
+                        "ms since boot, since start: returned " + since_start(t.start_returned_us) + ", ready " +
+                        since_start(t.ready_us) + ", httpd " + since_start(t.httpd_started_us) + ", udp " +
+                        since_start(t.udp_bound_us) + ", health probes " + since_start(t.health_probes_passed_us) +
+                        ", rollback confirmed " + since_start(t.rollback_confirmed_us));
+}
+
 void OtaHelper::reportStatus(OtaStatus status) {
   if (_ota_status_callback) {
     _ota_status_callback(status);
@@ -1021,6 +3828,10 @@ void OtaHelper::replaceAll(std::string &s, const std::string &search, const std:
   }
 }
 
+std::string OtaHelper::coreToString(BaseType_t core_id) {
+  return core_id == tskNO_AFFINITY ? std::string("any") : std::to_string(core_id);
+}
+
 std::string OtaHelper::trim(const std::string &str) {
 // Not optimal, need to figure out the ::ranges situation.
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 4, 0)
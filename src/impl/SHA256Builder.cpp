@@ -0,0 +1,36 @@
+#include "SHA256Builder.h"
+#include <cstring>
+#include <esp_idf_version.h>
+
+namespace ConnectionHelperUtils {
+
+SHA256Builder::SHA256Builder() { mbedtls_sha256_init(&_ctx); }
+
+SHA256Builder::~SHA256Builder() { mbedtls_sha256_free(&_ctx); }
+
+void SHA256Builder::begin() {
+  std::memset(_buf, 0x00, SHA256_DIGEST_LEN);
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0) // mbedtls 3+
+  mbedtls_sha256_starts(&_ctx, 0);
+#else
+  mbedtls_sha256_starts_ret(&_ctx, 0);
+#endif
+}
+
+void SHA256Builder::add(const uint8_t *data, size_t len) {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  mbedtls_sha256_update(&_ctx, data, len);
+#else
+  mbedtls_sha256_update_ret(&_ctx, data, len);
+#endif
+}
+
+void SHA256Builder::calculate() {
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  mbedtls_sha256_finish(&_ctx, _buf);
+#else
+  mbedtls_sha256_finish_ret(&_ctx, _buf);
+#endif
+}
+
+} // namespace ConnectionHelperUtils
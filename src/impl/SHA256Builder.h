@@ -0,0 +1,35 @@
+#ifndef __SHA256_BUILDER__
+#define __SHA256_BUILDER__
+
+#include "Hasher.h"
+#include <mbedtls/sha256.h>
+
+#define SHA256_DIGEST_LEN 32
+
+namespace ConnectionHelperUtils {
+
+/**
+ * @brief SHA-256 using mbedtls, which uses the SHA hardware accelerator where available.
+ */
+class SHA256Builder : public Hasher {
+public:
+  SHA256Builder();
+  ~SHA256Builder();
+  SHA256Builder(const SHA256Builder &) = delete;
+  SHA256Builder &operator=(const SHA256Builder &) = delete;
+
+  using Hasher::add;
+  void begin() override;
+  void add(const uint8_t *data, size_t len) override;
+  void calculate() override;
+  const uint8_t *digest() const override { return _buf; }
+  size_t digestLength() const override { return SHA256_DIGEST_LEN; }
+
+private:
+  mbedtls_sha256_context _ctx;
+  uint8_t _buf[SHA256_DIGEST_LEN];
+};
+
+} // namespace ConnectionHelperUtils
+
+#endif // __SHA256_BUILDER__
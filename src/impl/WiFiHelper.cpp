@@ -1,5 +1,6 @@
 #include "WiFiHelper.h"
 #include "LogHelper.h"
+#include <algorithm>
 #include <cstring>
 #include <esp_err.h>
 #include <esp_log.h>
@@ -12,26 +13,50 @@
 #include <lwip/sys.h>
 #include <nvs.h>
 #include <nvs_flash.h>
+#include <optional>
 
-// Event group bits
-#define WIFI_CONNECTED_BIT BIT0
+// Own events on the default event loop, so that all state transitions happen on the event loop task.
+ESP_EVENT_DEFINE_BASE(WIFI_HELPER_EVENT);
+#define WIFI_HELPER_EVENT_BACKOFF_EXPIRED 0
+#define BACKOFF_POST_RETRY_MS 100
 
 void WiFiHelper::eventHandler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
   WiFiHelper *_this = (WiFiHelper *)arg;
   if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+    _this->onConnectAttempt();
+    _this->setState(State::ASSOCIATING);
     esp_wifi_connect();
+  } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+    if (_this->_startup_timings.associated_us == 0) {
+      _this->_startup_timings.associated_us = esp_timer_get_time();
+    }
+    _this->setState(State::OBTAINING_IP);
   } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-    _this->log(ESP_LOG_WARN, "WiFi disconnected");
+    wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+    _this->log(ESP_LOG_WARN, "WiFi disconnected, reason: " + std::to_string(event->reason));
+
+    xSemaphoreTake(_this->_statistics_mutex, portMAX_DELAY);
+    _this->_statistics.disconnect_reasons[event->reason]++;
+    if (_this->_is_connected) {
+      _this->_statistics.connection_losses++;
+    }
+    xSemaphoreGive(_this->_statistics_mutex);
 
     auto on_disconnected = _this->_on_disconnected;
     if (_this->_is_connected && on_disconnected != nullptr) {
       on_disconnected();
     }
+    if (_this->_is_connected) {
+      _this->onConnectionStateChanged(false);
+    }
     _this->_is_connected = false;
+    xEventGroupClearBits(_this->_wifi_event_group, WIFI_HELPER_CONNECTED_BIT);
+    xEventGroupSetBits(_this->_wifi_event_group, WIFI_HELPER_DISCONNECTED_BIT);
 
     if (_this->_reconnect) {
-      _this->log(ESP_LOG_WARN, "Trying to reconnect...");
-      esp_wifi_connect();
+      _this->reconnectOrBackoff();
+    } else {
+      _this->setState(State::IDLE);
     }
 
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
@@ -42,13 +67,32 @@ void WiFiHelper::eventHandler(void *arg, esp_event_base_t event_base, int32_t ev
                                  "." + std::to_string(esp_ip4_addr4(&ipaddr)));
     memcpy(&_this->_ip_addr, &event->ip_info.ip, sizeof(esp_ip4_addr_t));
 
-    xEventGroupSetBits(_this->_wifi_event_group, WIFI_CONNECTED_BIT);
+    xEventGroupClearBits(_this->_wifi_event_group, WIFI_HELPER_DISCONNECTED_BIT);
+    xEventGroupSetBits(_this->_wifi_event_group, WIFI_HELPER_CONNECTED_BIT);
+
+    if (_this->_startup_timings.got_ip_us == 0) {
+      _this->_startup_timings.got_ip_us = esp_timer_get_time();
+      _this->logStartupTimings();
+    }
+
+    _this->onConnectionStateChanged(true);
+    _this->_backoff_next_ms = _this->_backoff_initial_ms;
+    _this->setState(State::CONNECTED);
 
     auto on_connected = _this->_on_connected;
     if (!_this->_is_connected && on_connected != nullptr) {
       on_connected();
     }
     _this->_is_connected = true;
+
+  } else if (event_base == WIFI_HELPER_EVENT && event_id == WIFI_HELPER_EVENT_BACKOFF_EXPIRED) {
+    // Might have been stopped or reconnected meanwhile.
+    if (!_this->_reconnect || _this->_state != State::BACKOFF) {
+      return;
+    }
+    _this->onConnectAttempt();
+    _this->setState(State::ASSOCIATING);
+    esp_wifi_connect();
   }
 }
 
@@ -56,19 +100,90 @@ WiFiHelper::WiFiHelper(const char *device_hostname, std::function<void(void)> on
                        std::function<void(void)> on_disconnected)
     : _device_hostname(device_hostname), _on_connected(on_connected), _on_disconnected(on_disconnected) {
   _wifi_event_group = xEventGroupCreate();
+  _statistics_mutex = xSemaphoreCreateMutex();
 }
 
 bool WiFiHelper::connectToAp(const char *ssid, const char *password, bool initializeNVS, int timeout_ms,
                              bool reconnect) {
+  if (!startWiFi(ssid, password, initializeNVS, reconnect)) {
+    return false;
+  }
+
+  if (waitForConnection(timeout_ms)) {
+    log(ESP_LOG_INFO, "connected to AP with SSID: " + std::string(ssid));
+    return true;
+  } else {
+    log(ESP_LOG_ERROR, "Unable to connect to AP, timeout.");
+  }
+
+  // On failure, cleanup.
+  disconnect();
+  return false;
+}
+
+bool WiFiHelper::connectToApAsync(const char *ssid, const char *password, bool initializeNVS, bool reconnect) {
+  return startWiFi(ssid, password, initializeNVS, reconnect);
+}
+
+bool WiFiHelper::waitForConnection(uint32_t timeout_ms) {
+  TickType_t xMaxBlockTime = timeout_ms == portMAX_DELAY ? portMAX_DELAY : timeout_ms / portTICK_PERIOD_MS;
+  EventBits_t bits =
+      xEventGroupWaitBits(_wifi_event_group, WIFI_HELPER_CONNECTED_BIT, pdFALSE, pdFALSE, xMaxBlockTime);
+
+  /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
+   * happened. */
+  return (bits & WIFI_HELPER_CONNECTED_BIT) != 0;
+}
+
+bool WiFiHelper::startWiFi(const char *ssid, const char *password, bool initializeNVS, bool reconnect) {
+  if (_wifi_started) {
+    stopWiFi();
+  }
   _reconnect = reconnect;
+  _backoff_next_ms = _backoff_initial_ms;
+  _startup_timings = {};
+  _startup_timings.connect_called_us = esp_timer_get_time();
   if (initializeNVS) {
     if (!this->initializeNVS()) {
       return false;
     }
+    _startup_timings.nvs_initialized_us = esp_timer_get_time();
+  }
+
+  xEventGroupClearBits(_wifi_event_group, WIFI_HELPER_CONNECTED_BIT);
+  xEventGroupSetBits(_wifi_event_group, WIFI_HELPER_DISCONNECTED_BIT);
+
+  if (_stack_initialized) {
+    // Warm start, netif, event loop, driver and handlers still alive from before suspend().
+    _startup_timings.netif_initialized_us = esp_timer_get_time();
+  } else if (!initializeStack()) {
+    return false;
   }
 
-  xEventGroupClearBits(_wifi_event_group, WIFI_CONNECTED_BIT);
+  wifi_config_t wifi_config = {};
+  std::strncpy((char *)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
+  std::strncpy((char *)wifi_config.sta.password, password, sizeof(wifi_config.sta.password));
 
+  if (!reportOnError(esp_wifi_set_mode(WIFI_MODE_STA), "failed to set wifi mode to STA")) {
+    return false;
+  }
+  if (!reportOnError(esp_wifi_set_config(WIFI_IF_STA, &wifi_config), "failed to set wifi config")) {
+    return false;
+  }
+  if (!reportOnError(esp_wifi_start(), "failed to start wifi")) {
+    return false;
+  }
+  _wifi_started = true;
+  _startup_timings.wifi_started_us = esp_timer_get_time();
+  resumeLinkMonitor();
+  if (!reportOnError(esp_wifi_set_ps(_power_save_mode), "failed to set power save mode")) {
+    return false;
+  }
+  log(ESP_LOG_INFO, "wifi_init_sta finished.");
+  return true;
+}
+
+bool WiFiHelper::initializeStack() {
   if (!reportOnError(esp_netif_init(), "failed to initialize netif")) {
     return false;
   }
@@ -81,69 +196,363 @@ bool WiFiHelper::connectToAp(const char *ssid, const char *password, bool initia
   if (!reportOnError(esp_netif_set_hostname(_netif_sta, _device_hostname), "failed to set hostname")) {
     return false;
   }
+  _startup_timings.netif_initialized_us = esp_timer_get_time();
 
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   if (!reportOnError(esp_wifi_init(&cfg), "failed to initialize wifi")) {
     return false;
   }
 
-  esp_event_handler_instance_t instance_any_id;
-  if (!reportOnError(
-          esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &eventHandler, this, &instance_any_id),
-          "failed to register event handler for any wifi event")) {
+  if (!reportOnError(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &eventHandler, this,
+                                                         &_instance_any_id),
+                     "failed to register event handler for any wifi event")) {
     return false;
   }
 
-  esp_event_handler_instance_t instance_got_ip;
-  if (!reportOnError(
-          esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &eventHandler, this, &instance_got_ip),
-          "failed to register event handler for IP event")) {
+  if (!reportOnError(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &eventHandler, this,
+                                                         &_instance_got_ip),
+                     "failed to register event handler for IP event")) {
     return false;
   }
 
-  wifi_config_t wifi_config = {};
-  std::strncpy((char *)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
-  std::strncpy((char *)wifi_config.sta.password, password, sizeof(wifi_config.sta.password));
-
-  if (!reportOnError(esp_wifi_set_mode(WIFI_MODE_STA), "failed to set wifi mode to STA")) {
+  if (!reportOnError(esp_event_handler_instance_register(WIFI_HELPER_EVENT, WIFI_HELPER_EVENT_BACKOFF_EXPIRED,
+                                                         &eventHandler, this, &_instance_backoff),
+                     "failed to register event handler for backoff event")) {
     return false;
   }
-  if (!reportOnError(esp_wifi_set_config(WIFI_IF_STA, &wifi_config), "failed to set wifi config")) {
+
+  _stack_initialized = true;
+  return true;
+}
+
+bool WiFiHelper::resume() {
+  if (!_stack_initialized) {
+    log(ESP_LOG_ERROR, "Unable to resume, not connected before. Use connectToAp() or connectToApAsync().");
     return false;
   }
-  if (!reportOnError(esp_wifi_start(), "failed to start wifi")) {
-    return false;
+  if (_wifi_started) {
+    return true; // Already running.
   }
-  log(ESP_LOG_INFO, "wifi_init_sta finished.");
 
-  TickType_t xMaxBlockTime = timeout_ms / portTICK_PERIOD_MS;
-  EventBits_t bits = xEventGroupWaitBits(_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdFALSE, xMaxBlockTime);
+  _reconnect = _reconnect_on_resume;
+  _backoff_next_ms = _backoff_initial_ms;
+  _startup_timings = {};
+  _startup_timings.connect_called_us = esp_timer_get_time();
+  _startup_timings.netif_initialized_us = _startup_timings.connect_called_us;
+  xEventGroupClearBits(_wifi_event_group, WIFI_HELPER_CONNECTED_BIT);
+  xEventGroupSetBits(_wifi_event_group, WIFI_HELPER_DISCONNECTED_BIT);
 
-  /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-   * happened. */
-  if ((bits & WIFI_CONNECTED_BIT) != 0) {
-    log(ESP_LOG_INFO, "connected to AP with SSID: " + std::string(ssid));
-    return true;
-  } else {
-    log(ESP_LOG_ERROR, "Unable to connect to AP, timeout.");
+  if (!reportOnError(esp_wifi_start(), "failed to start wifi")) {
+    return false;
   }
+  _wifi_started = true;
+  _startup_timings.wifi_started_us = esp_timer_get_time();
+  resumeLinkMonitor();
+  reportOnError(esp_wifi_set_ps(_power_save_mode), "failed to set power save mode");
+  log(ESP_LOG_INFO, "WiFi resumed.");
+  return true;
+}
 
-  // On failure, cleanup.
-  disconnect();
-  return false;
+void WiFiHelper::suspend() {
+  if (!_wifi_started) {
+    return;
+  }
+  _reconnect_on_resume = _reconnect;
+  stopWiFi();
+  log(ESP_LOG_INFO, "WiFi suspended.");
 }
 
 void WiFiHelper::disconnect() {
-  _reconnect = false;
-  esp_wifi_stop();
+  stopWiFi();
+  stopLinkMonitor();
+  if (_stack_initialized) {
+    esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, _instance_any_id);
+    esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, _instance_got_ip);
+    esp_event_handler_instance_unregister(WIFI_HELPER_EVENT, WIFI_HELPER_EVENT_BACKOFF_EXPIRED, _instance_backoff);
+    _stack_initialized = false;
+  }
   if (_netif_sta != nullptr) {
     esp_netif_destroy_default_wifi(_netif_sta);
+    _netif_sta = nullptr;
   }
   esp_event_loop_delete_default();
   esp_netif_deinit();
   esp_wifi_deinit();
 }
 
+void WiFiHelper::stopWiFi() {
+  _reconnect = false;
+  _wifi_started = false;
+  if (_link_monitor_timer != nullptr) {
+    esp_timer_stop(_link_monitor_timer); // Paused, see resumeLinkMonitor().
+  }
+  if (_backoff_timer != nullptr) {
+    esp_timer_stop(_backoff_timer);
+  }
+  // Cleared before stopping, so that the resulting WIFI_EVENT_STA_DISCONNECTED is not counted as a connection loss.
+  bool was_connected = _is_connected;
+  _is_connected = false;
+  esp_wifi_stop();
+  if (was_connected) {
+    onConnectionStateChanged(false);
+    if (_on_disconnected != nullptr) {
+      _on_disconnected();
+    }
+  }
+  xSemaphoreTake(_statistics_mutex, portMAX_DELAY);
+  auto now = esp_timer_get_time();
+  if (_state_since_us > 0) {
+    _statistics.disconnected_time_ms += (now - _state_since_us) / 1000;
+  }
+  _state_since_us = 0; // Not counting time while stopped.
+  _connect_attempt_us = 0;
+  xSemaphoreGive(_statistics_mutex);
+  xEventGroupClearBits(_wifi_event_group, WIFI_HELPER_CONNECTED_BIT);
+  xEventGroupSetBits(_wifi_event_group, WIFI_HELPER_DISCONNECTED_BIT);
+  setState(State::IDLE);
+}
+
+void WiFiHelper::setPowerSaveMode(wifi_ps_type_t power_save_mode) {
+  _power_save_mode = power_save_mode;
+  if (_wifi_started) {
+    reportOnError(esp_wifi_set_ps(_power_save_mode), "failed to set power save mode");
+  }
+}
+
+// #########################################################################
+// State
+// #########################################################################
+
+void WiFiHelper::setState(State state) {
+  if (_state == state) {
+    return;
+  }
+  _state = state;
+  for (const auto &on_state_changed : _on_state_changed) {
+    on_state_changed(state);
+  }
+}
+
+void WiFiHelper::reconnectOrBackoff() {
+  if (_backoff_next_ms == 0) {
+    log(ESP_LOG_WARN, "Trying to reconnect...");
+    onConnectAttempt();
+    setState(State::ASSOCIATING);
+    esp_wifi_connect();
+    return;
+  }
+
+  if (_backoff_timer == nullptr) {
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = &backoffTimerCallback;
+    timer_args.arg = this;
+    timer_args.name = "wifi_backoff";
+    if (!reportOnError(esp_timer_create(&timer_args, &_backoff_timer), "failed to create backoff timer")) {
+      _backoff_timer = nullptr;
+      _backoff_next_ms = 0; // Fallback to reconnect immediately.
+      reconnectOrBackoff();
+      return;
+    }
+  }
+
+  log(ESP_LOG_WARN, "Trying to reconnect in " + std::to_string(_backoff_next_ms) + "ms...");
+  setState(State::BACKOFF);
+  esp_timer_stop(_backoff_timer); // In case already running.
+  esp_timer_start_once(_backoff_timer, (uint64_t)_backoff_next_ms * 1000);
+  _backoff_next_ms = std::min(_backoff_next_ms * 2, _backoff_max_ms);
+}
+
+void WiFiHelper::logStartupTimings() {
+  auto &t = _startup_timings;
+  auto since = [](int64_t from_us, int64_t to_us) {
+    return from_us > 0 && to_us > 0 ? std::to_string((to_us - from_us) / 1000) + "ms" : std::string("-");
+  };
+  auto previous = [](int64_t a_us, int64_t b_us) { return b_us > 0 ? b_us : a_us; };
+  auto before_netif = previous(t.connect_called_us, t.nvs_initialized_us);
+  log(ESP_LOG_INFO, "Connected in " + since(t.connect_called_us, t.got_ip_us) + " (at " +
+                        std::to_string(t.got_ip_us / 1000) + "ms since boot): nvs " +
+                        since(t.connect_called_us, t.nvs_initialized_us) + ", netif " +
+                        since(before_netif, t.netif_initialized_us) + ", wifi start " +
+                        since(t.netif_initialized_us, t.wifi_started_us) + ", association " +
+                        since(t.wifi_started_us, t.associated_us) + ", dhcp " + since(t.associated_us, t.got_ip_us));
+}
+
+void WiFiHelper::backoffTimerCallback(void *arg) {
+  WiFiHelper *_this = (WiFiHelper *)arg;
+  // Handled on the event loop task, as all other state transitions. Without blocking the timer task, so retry shortly
+  // if the event queue is full.
+  if (esp_event_post(WIFI_HELPER_EVENT, WIFI_HELPER_EVENT_BACKOFF_EXPIRED, nullptr, 0, 0) != ESP_OK) {
+    esp_timer_start_once(_this->_backoff_timer, BACKOFF_POST_RETRY_MS * 1000);
+  }
+}
+
+// #########################################################################
+// Link statistics
+// #########################################################################
+
+bool WiFiHelper::startLinkMonitor(uint32_t sample_interval_ms, int8_t rssi_threshold_dbm,
+                                  OnLinkQualityChanged on_link_quality_changed, uint8_t hysteresis_db) {
+  stopLinkMonitor();
+
+  _link_monitor_interval_ms = sample_interval_ms;
+  _rssi_threshold_dbm = rssi_threshold_dbm;
+  _rssi_hysteresis_db = hysteresis_db;
+  _link_quality_good = true;
+  _on_link_quality_changed = on_link_quality_changed;
+
+  esp_timer_create_args_t timer_args = {};
+  timer_args.callback = &linkMonitorCallback;
+  timer_args.arg = this;
+  timer_args.name = "link_monitor";
+  if (!reportOnError(esp_timer_create(&timer_args, &_link_monitor_timer), "failed to create link monitor timer")) {
+    _link_monitor_timer = nullptr;
+    return false;
+  }
+  if (!reportOnError(esp_timer_start_periodic(_link_monitor_timer, (uint64_t)sample_interval_ms * 1000),
+                     "failed to start link monitor timer")) {
+    esp_timer_delete(_link_monitor_timer);
+    _link_monitor_timer = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void WiFiHelper::stopLinkMonitor() {
+  if (_link_monitor_timer != nullptr) {
+    esp_timer_stop(_link_monitor_timer);
+    esp_timer_delete(_link_monitor_timer);
+    _link_monitor_timer = nullptr;
+  }
+}
+
+/**
+ * @brief Restart a link monitor paused by stopWiFi(), with the same interval. No-op if not started.
+ */
+void WiFiHelper::resumeLinkMonitor() {
+  if (_link_monitor_timer == nullptr) {
+    return;
+  }
+  esp_timer_stop(_link_monitor_timer); // In case it is running, e.g. started before connecting.
+  reportOnError(esp_timer_start_periodic(_link_monitor_timer, (uint64_t)_link_monitor_interval_ms * 1000),
+                "failed to resume link monitor timer");
+}
+
+WiFiHelper::LinkStatistics WiFiHelper::getLinkStatistics() {
+  xSemaphoreTake(_statistics_mutex, portMAX_DELAY);
+  LinkStatistics statistics = _statistics;
+  if (_state_since_us > 0) {
+    // Include the ongoing period.
+    uint64_t elapsed_ms = (esp_timer_get_time() - _state_since_us) / 1000;
+    if (statistics.connected) {
+      statistics.connected_time_ms += elapsed_ms;
+    } else {
+      statistics.disconnected_time_ms += elapsed_ms;
+    }
+  }
+  xSemaphoreGive(_statistics_mutex);
+  return statistics;
+}
+
+void WiFiHelper::resetLinkStatistics() {
+  xSemaphoreTake(_statistics_mutex, portMAX_DELAY);
+  bool connected = _statistics.connected;
+  _statistics = {};
+  _statistics.connected = connected;
+  _rssi_sum = 0;
+  if (_state_since_us > 0) {
+    _state_since_us = esp_timer_get_time();
+  }
+  xSemaphoreGive(_statistics_mutex);
+}
+
+void WiFiHelper::linkMonitorCallback(void *arg) {
+  WiFiHelper *_this = (WiFiHelper *)arg;
+
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+    return; // Not connected.
+  }
+
+  std::optional<bool> quality_changed;
+  LinkStatistics statistics;
+
+  xSemaphoreTake(_this->_statistics_mutex, portMAX_DELAY);
+  auto &s = _this->_statistics;
+  s.rssi = ap_info.rssi;
+  s.rssi_min = s.rssi_samples == 0 ? ap_info.rssi : std::min(s.rssi_min, ap_info.rssi);
+  s.rssi_max = s.rssi_samples == 0 ? ap_info.rssi : std::max(s.rssi_max, ap_info.rssi);
+  _this->_rssi_sum += ap_info.rssi;
+  s.rssi_samples++;
+  s.rssi_average = (int8_t)(_this->_rssi_sum / (int64_t)s.rssi_samples);
+  s.channel = ap_info.primary;
+  s.phy_11b = ap_info.phy_11b;
+  s.phy_11g = ap_info.phy_11g;
+  s.phy_11n = ap_info.phy_11n;
+  s.phy_lr = ap_info.phy_lr;
+
+  if (_this->_link_quality_good && ap_info.rssi < _this->_rssi_threshold_dbm) {
+    _this->_link_quality_good = false;
+    quality_changed = false;
+  } else if (!_this->_link_quality_good &&
+             ap_info.rssi >= _this->_rssi_threshold_dbm + _this->_rssi_hysteresis_db) {
+    _this->_link_quality_good = true;
+    quality_changed = true;
+  }
+  if (quality_changed && _this->_on_link_quality_changed) {
+    statistics = s;
+  }
+  xSemaphoreGive(_this->_statistics_mutex);
+
+  if (quality_changed) {
+    _this->log(*quality_changed ? ESP_LOG_INFO : ESP_LOG_WARN,
+               "Link quality " + std::string(*quality_changed ? "recovered" : "degraded") +
+                   ", RSSI: " + std::to_string(ap_info.rssi) + " dBm");
+    if (_this->_on_link_quality_changed) {
+      _this->_on_link_quality_changed(*quality_changed, statistics);
+    }
+  }
+}
+
+void WiFiHelper::onConnectAttempt() {
+  xSemaphoreTake(_statistics_mutex, portMAX_DELAY);
+  auto now = esp_timer_get_time();
+  if (_state_since_us == 0) {
+    _state_since_us = now; // WiFi started, start counting disconnected time.
+  }
+  if (_connect_attempt_us == 0) {
+    _connect_attempt_us = now; // Measure time to IP from the first attempt in a series of retries.
+  }
+  xSemaphoreGive(_statistics_mutex);
+}
+
+void WiFiHelper::onConnectionStateChanged(bool connected) {
+  xSemaphoreTake(_statistics_mutex, portMAX_DELAY);
+  auto now = esp_timer_get_time();
+  if (_state_since_us > 0) {
+    uint64_t elapsed_ms = (now - _state_since_us) / 1000;
+    if (_statistics.connected) {
+      _statistics.connected_time_ms += elapsed_ms;
+    } else {
+      _statistics.disconnected_time_ms += elapsed_ms;
+    }
+  }
+  _state_since_us = now;
+  _statistics.connected = connected;
+
+  if (connected && _connect_attempt_us > 0) {
+    uint32_t time_to_ip_ms = (now - _connect_attempt_us) / 1000;
+    _statistics.ip_acquisitions++;
+    _statistics.last_time_to_ip_ms = time_to_ip_ms;
+    _statistics.max_time_to_ip_ms = std::max(_statistics.max_time_to_ip_ms, time_to_ip_ms);
+    _connect_attempt_us = 0;
+  }
+  xSemaphoreGive(_statistics_mutex);
+}
+
+// #########################################################################
+// Utils
+// #########################################################################
+
 bool WiFiHelper::initializeNVS() {
   log(ESP_LOG_INFO, "Initializing NVS");
   // Initialize NVS